@@ -29,6 +29,12 @@ desktop_capture_get_name (void *type_data)
   return obs_module_text ("DesktopCapture");
 }
 
+static const char *
+desktop_capture_async_get_name (void *type_data)
+{
+  return obs_module_text ("DesktopCaptureAsync");
+}
+
 static void *
 desktop_capture_create (obs_data_t   *settings,
                         obs_source_t *source)
@@ -98,7 +104,7 @@ desktop_capture_register_source (void)
   struct obs_source_info info = {
     .id = "obs-xdg-source",
     .type = OBS_SOURCE_TYPE_INPUT,
-    .output_flags = OBS_SOURCE_VIDEO,
+    .output_flags = OBS_SOURCE_VIDEO | OBS_SOURCE_CUSTOM_DRAW,
     .get_name = desktop_capture_get_name,
     .create = desktop_capture_create,
     .destroy = desktop_capture_destroy,
@@ -114,4 +120,21 @@ desktop_capture_register_source (void)
   };
 
   obs_register_source (&info);
+
+  struct obs_source_info async_info = {
+    .id = "obs-xdg-source-async",
+    .type = OBS_SOURCE_TYPE_INPUT,
+    .output_flags = OBS_SOURCE_ASYNC_VIDEO,
+    .get_name = desktop_capture_async_get_name,
+    .create = desktop_capture_create,
+    .destroy = desktop_capture_destroy,
+    .get_defaults = desktop_capture_get_defaults,
+    .get_properties = desktop_capture_get_properties,
+    .update = desktop_capture_update,
+    .show = desktop_capture_show,
+    .hide = desktop_capture_hide,
+    .icon_type = OBS_ICON_TYPE_DESKTOP_CAPTURE,
+  };
+
+  obs_register_source (&async_info);
 }
@@ -0,0 +1,426 @@
+/* frame-sink.c
+ *
+ * Copyright 2020 Georges Basile Stavracas Neto <georges.stavracas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "frame-sink.h"
+
+#include <glib.h>
+#include <string.h>
+
+/* Textures of every sink, only the fields of their sink are used */
+struct _obs_pw_texture
+{
+  const obs_pw_frame_sink *sink;
+  uint32_t width;
+  uint32_t height;
+
+  /* libobs sink */
+  gs_texture_t *texture;
+
+  /* Null sink, the pixels live in system memory */
+  uint32_t linesize;
+  uint8_t *data;
+};
+
+static const obs_pw_frame_sink *current_sink = &obs_pw_libobs_frame_sink;
+
+/* libobs sink, its textures wrap a gs_texture_t */
+
+static obs_pw_texture *
+wrap_gs_texture (gs_texture_t *gs_texture)
+{
+  obs_pw_texture *texture;
+
+  if (!gs_texture)
+    return NULL;
+
+  texture = bzalloc (sizeof (obs_pw_texture));
+  texture->width = gs_texture_get_width (gs_texture);
+  texture->height = gs_texture_get_height (gs_texture);
+  texture->texture = gs_texture;
+
+  return texture;
+}
+
+static void
+libobs_lock (void)
+{
+  obs_enter_graphics ();
+}
+
+static void
+libobs_unlock (void)
+{
+  obs_leave_graphics ();
+}
+
+static bool
+libobs_query_dmabuf_capabilities (enum gs_dmabuf_flags  *dmabuf_flags,
+                                  uint32_t             **drm_formats,
+                                  size_t                *n_drm_formats)
+{
+  return gs_query_dmabuf_capabilities (dmabuf_flags, drm_formats, n_drm_formats);
+}
+
+static bool
+libobs_query_dmabuf_modifiers (uint32_t   drm_format,
+                               uint64_t **modifiers,
+                               size_t    *n_modifiers)
+{
+  return gs_query_dmabuf_modifiers_for_format (drm_format, modifiers, n_modifiers);
+}
+
+static obs_pw_texture *
+libobs_texture_create (uint32_t              width,
+                       uint32_t              height,
+                       enum gs_color_format  format,
+                       const uint8_t        *data)
+{
+  return wrap_gs_texture (gs_texture_create (width, height, format, 1,
+                                            data ? &data : NULL, GS_DYNAMIC));
+}
+
+static obs_pw_texture *
+libobs_texture_import_dmabuf (uint32_t              width,
+                              uint32_t              height,
+                              uint32_t              drm_format,
+                              enum gs_color_format  format,
+                              uint32_t              n_planes,
+                              const int            *fds,
+                              const uint32_t       *strides,
+                              const uint32_t       *offsets,
+                              const uint64_t       *modifiers)
+{
+  return wrap_gs_texture (gs_texture_create_from_dmabuf (width, height, drm_format, format, n_planes,
+                                                         fds, strides, offsets, modifiers));
+}
+
+static void
+libobs_texture_destroy (obs_pw_texture *texture)
+{
+  gs_texture_destroy (texture->texture);
+  bfree (texture);
+}
+
+static void
+libobs_texture_set_image (obs_pw_texture *texture,
+                          const uint8_t  *data,
+                          uint32_t        linesize)
+{
+  gs_texture_set_image (texture->texture, data, linesize, false);
+}
+
+static bool
+libobs_texture_map (obs_pw_texture  *texture,
+                    uint8_t        **ptr,
+                    uint32_t        *linesize)
+{
+  return gs_texture_map (texture->texture, ptr, linesize);
+}
+
+static void
+libobs_texture_unmap (obs_pw_texture *texture)
+{
+  gs_texture_unmap (texture->texture);
+}
+
+static gs_texture_t *
+libobs_texture_get_gs_texture (obs_pw_texture *texture)
+{
+  return texture->texture;
+}
+
+const obs_pw_frame_sink obs_pw_libobs_frame_sink = {
+  .name = "libobs",
+  .draws = true,
+  .lock = libobs_lock,
+  .unlock = libobs_unlock,
+  .query_dmabuf_capabilities = libobs_query_dmabuf_capabilities,
+  .query_dmabuf_modifiers = libobs_query_dmabuf_modifiers,
+  .texture_create = libobs_texture_create,
+  .texture_import_dmabuf = libobs_texture_import_dmabuf,
+  .texture_destroy = libobs_texture_destroy,
+  .texture_set_image = libobs_texture_set_image,
+  .texture_map = libobs_texture_map,
+  .texture_unmap = libobs_texture_unmap,
+  .texture_get_gs_texture = libobs_texture_get_gs_texture,
+};
+
+/*
+ * Null sink, its textures live in system memory. Uploads are real copies,
+ * so the CPU cost of the pipeline is kept, and DMA-BUFs are never offered.
+ */
+
+static GRecMutex null_lock;
+static obs_pw_null_sink_stats null_stats;
+
+static void
+null_lock_acquire (void)
+{
+  g_rec_mutex_lock (&null_lock);
+}
+
+static void
+null_lock_release (void)
+{
+  g_rec_mutex_unlock (&null_lock);
+}
+
+static bool
+null_query_dmabuf_capabilities (enum gs_dmabuf_flags  *dmabuf_flags,
+                                uint32_t             **drm_formats,
+                                size_t                *n_drm_formats)
+{
+  return false;
+}
+
+static bool
+null_query_dmabuf_modifiers (uint32_t   drm_format,
+                             uint64_t **modifiers,
+                             size_t    *n_modifiers)
+{
+  return false;
+}
+
+static void
+null_texture_set_image (obs_pw_texture *texture,
+                        const uint8_t  *data,
+                        uint32_t        linesize)
+{
+  for (uint32_t y = 0; y < texture->height; y++)
+    memcpy (texture->data + (size_t) y * texture->linesize, data + (size_t) y * linesize, texture->linesize);
+
+  null_stats.uploads++;
+  null_stats.bytes_uploaded += (uint64_t) texture->linesize * texture->height;
+}
+
+static obs_pw_texture *
+null_texture_create (uint32_t              width,
+                     uint32_t              height,
+                     enum gs_color_format  format,
+                     const uint8_t        *data)
+{
+  obs_pw_texture *texture = bzalloc (sizeof (obs_pw_texture));
+
+  texture->width = width;
+  texture->height = height;
+  texture->linesize = width * gs_get_format_bpp (format) / 8;
+  texture->data = bmalloc ((size_t) texture->linesize * height);
+
+  null_stats.textures_created++;
+
+  if (data)
+    null_texture_set_image (texture, data, texture->linesize);
+
+  return texture;
+}
+
+static obs_pw_texture *
+null_texture_import_dmabuf (uint32_t              width,
+                            uint32_t              height,
+                            uint32_t              drm_format,
+                            enum gs_color_format  format,
+                            uint32_t              n_planes,
+                            const int            *fds,
+                            const uint32_t       *strides,
+                            const uint32_t       *offsets,
+                            const uint64_t       *modifiers)
+{
+  null_stats.dmabuf_imports++;
+  return NULL;
+}
+
+static void
+null_texture_destroy (obs_pw_texture *texture)
+{
+  bfree (texture->data);
+  bfree (texture);
+}
+
+static bool
+null_texture_map (obs_pw_texture  *texture,
+                  uint8_t        **ptr,
+                  uint32_t        *linesize)
+{
+  *ptr = texture->data;
+  *linesize = texture->linesize;
+  return true;
+}
+
+/* Mapped textures are written in place, count them as a whole upload */
+static void
+null_texture_unmap (obs_pw_texture *texture)
+{
+  null_stats.uploads++;
+  null_stats.bytes_uploaded += (uint64_t) texture->linesize * texture->height;
+}
+
+const obs_pw_frame_sink obs_pw_null_frame_sink = {
+  .name = "null",
+  .draws = false,
+  .lock = null_lock_acquire,
+  .unlock = null_lock_release,
+  .query_dmabuf_capabilities = null_query_dmabuf_capabilities,
+  .query_dmabuf_modifiers = null_query_dmabuf_modifiers,
+  .texture_create = null_texture_create,
+  .texture_import_dmabuf = null_texture_import_dmabuf,
+  .texture_destroy = null_texture_destroy,
+  .texture_set_image = null_texture_set_image,
+  .texture_map = null_texture_map,
+  .texture_unmap = null_texture_unmap,
+};
+
+/* The stats are written with the sink lock held */
+void
+obs_pw_null_frame_sink_get_stats (obs_pw_null_sink_stats *stats)
+{
+  null_lock_acquire ();
+  *stats = null_stats;
+  null_lock_release ();
+}
+
+/* Only to be changed before any capture starts */
+void
+frame_sink_set (const obs_pw_frame_sink *sink)
+{
+  current_sink = sink;
+}
+
+const obs_pw_frame_sink *
+frame_sink_get (void)
+{
+  return current_sink;
+}
+
+bool
+frame_sink_draws (void)
+{
+  return current_sink->draws;
+}
+
+void
+frame_sink_lock (void)
+{
+  current_sink->lock ();
+}
+
+void
+frame_sink_unlock (void)
+{
+  current_sink->unlock ();
+}
+
+bool
+frame_sink_query_dmabuf_capabilities (enum gs_dmabuf_flags  *dmabuf_flags,
+                                      uint32_t             **drm_formats,
+                                      size_t                *n_drm_formats)
+{
+  return current_sink->query_dmabuf_capabilities (dmabuf_flags, drm_formats, n_drm_formats);
+}
+
+bool
+frame_sink_query_dmabuf_modifiers (uint32_t   drm_format,
+                                   uint64_t **modifiers,
+                                   size_t    *n_modifiers)
+{
+  return current_sink->query_dmabuf_modifiers (drm_format, modifiers, n_modifiers);
+}
+
+obs_pw_texture *
+frame_sink_texture_create (uint32_t              width,
+                           uint32_t              height,
+                           enum gs_color_format  format,
+                           const uint8_t        *data)
+{
+  obs_pw_texture *texture = current_sink->texture_create (width, height, format, data);
+
+  if (texture)
+    texture->sink = current_sink;
+
+  return texture;
+}
+
+obs_pw_texture *
+frame_sink_texture_import_dmabuf (uint32_t              width,
+                                  uint32_t              height,
+                                  uint32_t              drm_format,
+                                  enum gs_color_format  format,
+                                  uint32_t              n_planes,
+                                  const int            *fds,
+                                  const uint32_t       *strides,
+                                  const uint32_t       *offsets,
+                                  const uint64_t       *modifiers)
+{
+  obs_pw_texture *texture = current_sink->texture_import_dmabuf (width, height, drm_format, format, n_planes,
+                                                                 fds, strides, offsets, modifiers);
+
+  if (texture)
+    texture->sink = current_sink;
+
+  return texture;
+}
+
+void
+frame_sink_texture_destroy (obs_pw_texture *texture)
+{
+  texture->sink->texture_destroy (texture);
+}
+
+uint32_t
+frame_sink_texture_get_width (obs_pw_texture *texture)
+{
+  return texture->width;
+}
+
+uint32_t
+frame_sink_texture_get_height (obs_pw_texture *texture)
+{
+  return texture->height;
+}
+
+void
+frame_sink_texture_set_image (obs_pw_texture *texture,
+                              const uint8_t  *data,
+                              uint32_t        linesize)
+{
+  texture->sink->texture_set_image (texture, data, linesize);
+}
+
+bool
+frame_sink_texture_map (obs_pw_texture  *texture,
+                        uint8_t        **ptr,
+                        uint32_t        *linesize)
+{
+  return texture->sink->texture_map (texture, ptr, linesize);
+}
+
+void
+frame_sink_texture_unmap (obs_pw_texture *texture)
+{
+  texture->sink->texture_unmap (texture);
+}
+
+gs_texture_t *
+frame_sink_texture_get_gs_texture (obs_pw_texture *texture)
+{
+  if (!texture->sink->texture_get_gs_texture)
+    return NULL;
+
+  return texture->sink->texture_get_gs_texture (texture);
+}
@@ -0,0 +1,139 @@
+/* frame-sink.h
+ *
+ * Copyright 2020 Georges Basile Stavracas Neto <georges.stavracas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <obs/obs-module.h>
+
+/*
+ * Frame sinks receive the frames of the capture pipeline: the memory
+ * uploads, the DMA-BUF imports and the cursor bitmaps. The libobs sink turns
+ * them into textures, the null sink only copies them into system memory and
+ * counts them, so the rest of the pipeline can be profiled apart from
+ * texture uploads and drawing.
+ *
+ * Frames are processed with the sink lock held, which the PipeWire thread
+ * never takes. The libobs sink uses the graphics lock, the null sink a lock
+ * of its own, so it runs without a graphics context.
+ *
+ * Textures remember the sink that created them, so they are always handed
+ * back to it, even if another sink was set in between.
+ */
+
+typedef struct _obs_pw_texture obs_pw_texture;
+
+typedef struct
+{
+  const char *name;
+
+  /* Whether sources draw the frames, or only run the pipeline */
+  bool draws;
+
+  void (*lock) (void);
+  void (*unlock) (void);
+
+  bool (*query_dmabuf_capabilities) (enum gs_dmabuf_flags  *dmabuf_flags,
+                                     uint32_t             **drm_formats,
+                                     size_t                *n_drm_formats);
+  bool (*query_dmabuf_modifiers) (uint32_t   drm_format,
+                                  uint64_t **modifiers,
+                                  size_t    *n_modifiers);
+
+  obs_pw_texture * (*texture_create) (uint32_t              width,
+                                      uint32_t              height,
+                                      enum gs_color_format  format,
+                                      const uint8_t        *data);
+  obs_pw_texture * (*texture_import_dmabuf) (uint32_t              width,
+                                             uint32_t              height,
+                                             uint32_t              drm_format,
+                                             enum gs_color_format  format,
+                                             uint32_t              n_planes,
+                                             const int            *fds,
+                                             const uint32_t       *strides,
+                                             const uint32_t       *offsets,
+                                             const uint64_t       *modifiers);
+  void (*texture_destroy) (obs_pw_texture *texture);
+
+  void (*texture_set_image) (obs_pw_texture *texture,
+                             const uint8_t  *data,
+                             uint32_t        linesize);
+  bool (*texture_map) (obs_pw_texture  *texture,
+                       uint8_t        **ptr,
+                       uint32_t        *linesize);
+  void (*texture_unmap) (obs_pw_texture *texture);
+
+  /* The texture to draw, only called for sinks that draw */
+  gs_texture_t * (*texture_get_gs_texture) (obs_pw_texture *texture);
+} obs_pw_frame_sink;
+
+typedef struct
+{
+  uint64_t textures_created;
+  uint64_t dmabuf_imports;
+  uint64_t uploads;
+  uint64_t bytes_uploaded;
+} obs_pw_null_sink_stats;
+
+extern const obs_pw_frame_sink obs_pw_libobs_frame_sink;
+extern const obs_pw_frame_sink obs_pw_null_frame_sink;
+
+void obs_pw_null_frame_sink_get_stats (obs_pw_null_sink_stats *stats);
+
+void frame_sink_set (const obs_pw_frame_sink *sink);
+const obs_pw_frame_sink *frame_sink_get (void);
+bool frame_sink_draws (void);
+
+void frame_sink_lock (void);
+void frame_sink_unlock (void);
+
+bool frame_sink_query_dmabuf_capabilities (enum gs_dmabuf_flags  *dmabuf_flags,
+                                           uint32_t             **drm_formats,
+                                           size_t                *n_drm_formats);
+bool frame_sink_query_dmabuf_modifiers (uint32_t   drm_format,
+                                        uint64_t **modifiers,
+                                        size_t    *n_modifiers);
+
+obs_pw_texture * frame_sink_texture_create (uint32_t              width,
+                                            uint32_t              height,
+                                            enum gs_color_format  format,
+                                            const uint8_t        *data);
+obs_pw_texture * frame_sink_texture_import_dmabuf (uint32_t              width,
+                                                   uint32_t              height,
+                                                   uint32_t              drm_format,
+                                                   enum gs_color_format  format,
+                                                   uint32_t              n_planes,
+                                                   const int            *fds,
+                                                   const uint32_t       *strides,
+                                                   const uint32_t       *offsets,
+                                                   const uint64_t       *modifiers);
+void frame_sink_texture_destroy (obs_pw_texture *texture);
+
+uint32_t frame_sink_texture_get_width (obs_pw_texture *texture);
+uint32_t frame_sink_texture_get_height (obs_pw_texture *texture);
+
+void frame_sink_texture_set_image (obs_pw_texture *texture,
+                                   const uint8_t  *data,
+                                   uint32_t        linesize);
+bool frame_sink_texture_map (obs_pw_texture  *texture,
+                             uint8_t        **ptr,
+                             uint32_t        *linesize);
+void frame_sink_texture_unmap (obs_pw_texture *texture);
+
+gs_texture_t * frame_sink_texture_get_gs_texture (obs_pw_texture *texture);
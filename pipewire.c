@@ -19,12 +19,24 @@
  */
 
 #include "pipewire.h"
+#include "frame-sink.h"
+
+#include <obs/util/platform.h>
 
 #include <gio/gio.h>
 #include <gio/gunixfdlist.h>
 
+#include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <libdrm/drm_fourcc.h>
 #include <linux/dma-buf.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <pipewire/pipewire.h>
 #include <spa/param/video/format-utils.h>
 #include <spa/debug/types.h>
@@ -33,11 +45,146 @@
 #define REQUEST_PATH "/org/freedesktop/portal/desktop/request/%s/obs%u"
 #define SESSION_PATH "/org/freedesktop/portal/desktop/session/%s/obs%u"
 
+#define FORMAT_PARAMS_BUFFER_SIZE 8192
+
+/* Meta params for crop, cursor, damage and header, and the Buffers param */
+#define N_BUFFER_PARAMS 5
+
+#define NSEC_PER_SEC 1000000000LL
+
+#define MAX_FRAMERATE 360
+
+/*
+ * Frames up to MAX_CAPTURE_SIZE can be negotiated. Memory buffers larger
+ * than what the GPU can hold in a single texture are split into tiles of
+ * TILE_SIZE, which every GPU OBS runs on supports.
+ */
+#define MAX_CAPTURE_SIZE 16384
+#define TILE_SIZE 4096
+
+#define MAX_DMABUF_PLANES 4
+#define MAX_MEMORY_PLANES 3
+
+/* Only defined by fcntl.h with _GNU_SOURCE */
+#ifndef F_GET_SEALS
+#define F_GET_SEALS 1034
+#define F_SEAL_SHRINK 0x0002
+#endif
+
+#define DAMAGE_META_SIZE(n_regions) \
+ (sizeof(struct spa_meta_region) * n_regions)
+
 #define CURSOR_META_SIZE(width, height) \
  (sizeof(struct spa_meta_cursor) + \
   sizeof(struct spa_meta_bitmap) + width * height * 4)
 
-struct _obs_pipewire_data
+#define CURSOR_CACHE_SIZE 8
+
+/* Most frames waiting to be shown, the actual depth depends on the buffer pool */
+#define FRAME_QUEUE_SIZE 8
+
+#define STATS_LOG_INTERVAL (60 * NSEC_PER_SEC)
+
+/* Upper bounds of the latency histogram buckets, the last one is open */
+static const uint32_t latency_buckets_ms[] = { 1, 2, 4, 8, 16, 33, 66, 133 };
+
+#define N_LATENCY_BUCKETS (G_N_ELEMENTS (latency_buckets_ms) + 1)
+
+/* Frames the latency percentiles are computed over */
+#define TIMING_WINDOW 512
+
+/*
+ * A single PipeWire thread and context serve every capture source. Each
+ * portal session only connects its own core, with the fd handed out by the
+ * portal, and each source adds its own stream to it.
+ */
+static struct
+{
+  GMutex lock;
+  unsigned int refcount;
+  struct pw_thread_loop *thread_loop;
+  struct pw_context *context;
+} shared_pipewire;
+
+typedef enum
+{
+  CAPTURE_RESOLUTION_NATIVE = 0,
+  CAPTURE_RESOLUTION_SCALED = 1,
+  CAPTURE_RESOLUTION_CUSTOM = 2,
+} obs_pw_capture_resolution;
+
+typedef enum
+{
+  LATENCY_MODE_LOW = 0,
+  LATENCY_MODE_BALANCED = 1,
+  LATENCY_MODE_SMOOTH = 2,
+} obs_pw_latency_mode;
+
+/*
+ * Buffer pool asked from the compositor for each latency mode, as preferred,
+ * minimum and maximum number of buffers. Deeper pools let more frames wait
+ * to be shown without starving the compositor. OBS may hold two buffers at
+ * once, the frame shown and the next one, so pools have at least three.
+ */
+static const struct {
+  uint32_t buffers;
+  uint32_t min_buffers;
+  uint32_t max_buffers;
+} latency_mode_pools[] = {
+  [LATENCY_MODE_LOW] = { 3, 3, 3 },
+  [LATENCY_MODE_BALANCED] = { 6, 4, 8 },
+  [LATENCY_MODE_SMOOTH] = { 10, 8, 16 },
+};
+
+/* A cursor bitmap that was already uploaded, see lookup_cursor_texture() */
+typedef struct
+{
+  uint32_t id;
+  uint64_t hash;
+  uint32_t width;
+  uint32_t height;
+  enum gs_color_format format;
+  uint64_t last_used;
+  obs_pw_texture *texture;
+} obs_pw_cursor_shape;
+
+/*
+ * Timeline of a frame, from the compositor to the screen, in os_gettime_ns()
+ * time. Unknown steps are 0.
+ */
+typedef struct
+{
+  uint64_t sequence;
+  int64_t  pts;
+  uint64_t dequeued;
+  uint64_t ready;
+  uint64_t rendered;
+  uint64_t requeued;
+} obs_pw_frame_timing;
+
+typedef struct
+{
+  uint32_t x, y;
+  uint32_t width, height;
+} obs_pw_rect;
+
+/*
+ * Area of the monitor or window to capture, in native pixels relative to
+ * the top left corner of the cropped frame.
+ */
+typedef struct
+{
+  bool enabled;
+  uint32_t x, y;
+  uint32_t width, height;
+} obs_pw_region;
+
+/*
+ * A ScreenCast portal session. Sources created together share a session, so
+ * a single dialog picks the streams of all of them, and all those streams
+ * are played through a single PipeWire connection.
+ */
+typedef struct _obs_pw_session
 {
   GDBusConnection *connection;
   GDBusProxy      *proxy;
@@ -45,28 +192,143 @@ struct _obs_pipewire_data
 
   char            *sender_name;
   char            *session_handle;
-
-  uint32_t         pipewire_node;
-  int              pipewire_fd;
+  char            *restore_token;
 
   uint32_t         available_cursor_modes;
+  uint32_t         portal_version;
 
-  obs_source_t    *source;
-  obs_data_t      *settings;
+  /* What every member asks for */
+  uint32_t         capture_types;
+  bool             async;
+  bool             cursor_visible;
+
+  /* obs_pipewire_data */
+  GPtrArray       *members;
+
+  /* obs_pw_capture, one per node played */
+  GPtrArray       *captures;
 
-  gs_texture_t *texture;
+  /* Streams returned by Start, a(ua{sv}) */
+  GVariant        *streams;
 
+  int              pipewire_fd;
+
+  /* Borrowed from shared_pipewire while connected */
   struct pw_thread_loop *thread_loop;
   struct pw_context *context;
 
   struct pw_core *core;
   struct spa_hook core_listener;
+} obs_pw_session;
+
+/* Sources waiting to be batched into sessions, see queue_source() */
+G_LOCK_DEFINE_STATIC (pending_sources);
+static GPtrArray *pending_sources = NULL;
+
+/* obs_pw_session that can be joined by restoring their token */
+static GList *active_sessions = NULL;
+
+/*
+ * Chrome trace (chrome://tracing, Perfetto) of every frame, written when
+ * OBS_PIPEWIRE_TRACE names a file. Only written by the render thread.
+ */
+static FILE *trace_file = NULL;
+
+/*
+ * A PipeWire stream and everything derived from its frames. Sources of a
+ * session that capture the same node share a single capture, so that the
+ * compositor produces every frame once, and it's uploaded once. Settings
+ * of the sources themselves are only applied when rendering.
+ */
+typedef struct
+{
+  obs_pw_session *session;
+  uint32_t        node;
+
+  /*
+   * obs_pipewire_data showing this capture. Only changed with the thread
+   * loop locked, as async frames are output to them from the PipeWire thread.
+   */
+  GPtrArray      *sources;
+
+  obs_pw_texture *texture;
+  obs_pw_texture *memory_textures[MAX_MEMORY_PLANES];
+  gs_effect_t    *yuv_effect;
+
+  /* Tiles of memory buffers too large for one texture, in row-major order */
+  GPtrArray      *tiles;
+  uint32_t        n_tile_columns;
+
+  /*
+   * Part of the frame held by the memory textures. Only the union of the
+   * regions of the sources is uploaded, and it covers the whole frame if any
+   * source has no region. Changed with the sink lock held.
+   */
+  obs_pw_rect   upload;
+  obs_pw_region region;
+
+  /* Borrowed from the session while the stream is playing */
+  struct pw_thread_loop *thread_loop;
 
   struct pw_stream *stream;
   struct spa_hook stream_listener;
+
+  /*
+   * Guards what the PipeWire thread and the render thread both change: the
+   * frame queue, the format info, stream_format and removed_textures.
+   * PipeWire callbacks only ever take this lock, never the sink lock, which
+   * may be the graphics lock and held for a whole render. The render thread
+   * takes it with the sink lock held.
+   */
+  GMutex frame_lock;
+
+  /*
+   * The negotiated format as seen by the PipeWire thread, and the copy the
+   * render thread uses. The render thread picks stream_format up when
+   * format_changed is set, so format is only touched by the render thread.
+   */
+  struct spa_video_info stream_format;
   struct spa_video_info format;
+  bool format_changed;
+
+  /* Textures of removed buffers, destroyed by the render thread */
+  GPtrArray *removed_textures;
+
+  /* obs_pw_format_info, in order of preference */
+  GArray *format_info;
+  struct spa_source *reneg;
+  struct spa_source *requeue;
 
+  /*
+   * Frames are handed from the PipeWire thread to the render thread through
+   * a ring of single-slot mailboxes: the PipeWire thread publishes every
+   * buffer in the next slot of pending_pw_buffers, taking back whatever the
+   * render thread didn't collect in time. The render thread collects them
+   * into queued_pw_buffers, oldest first, and holds the frame it shows as
+   * current_pw_buffer until another frame replaces it.
+   *
+   * pw_stream_queue_buffer() only supports a single producer, so the render
+   * thread never calls it: buffers it is done with are pushed on the
+   * returned_pw_buffers stack, which only the PipeWire thread drains.
+   * Anything but the pending slots is changed with frame_lock held.
+   */
+  struct pw_buffer *pending_pw_buffers[FRAME_QUEUE_SIZE];
+  uint64_t          pending_sequence;
+  struct pw_buffer *queued_pw_buffers[FRAME_QUEUE_SIZE];
+  uint32_t          n_queued_pw_buffers;
   struct pw_buffer *current_pw_buffer;
+  int64_t           current_pts;
+  struct pw_buffer *returned_pw_buffers;
+
+  /* Buffers in the pool, accessed atomically */
+  gint n_buffers;
+
+  /*
+   * Set whenever a frame is dropped without being uploaded. The damage
+   * regions of the next frame are then not enough to bring the memory
+   * texture up to date, and a full upload is needed.
+   */
+  int damage_lost;
 
   struct {
     bool valid;
@@ -75,24 +337,199 @@ struct _obs_pipewire_data
   } crop;
 
   struct {
-    bool visible;
     bool valid;
     int x, y;
     int hotspot_x, hotspot_y;
     int width, height;
-    gs_texture_t *texture;
+    obs_pw_texture *texture;
+
+    /* Recently seen cursor shapes, evicted least recently used first */
+    obs_pw_cursor_shape cache[CURSOR_CACHE_SIZE];
+    uint64_t serial;
   } cursor;
 
-  obs_pw_capture_type capture_type;
   bool negotiated;
+
+  /* Size of the captured monitor or window, 0 until known */
+  uint32_t native_width;
+  uint32_t native_height;
+
+  /*
+   * Size the portal gives the stream, if any. It is in logical coordinates
+   * for monitors, so it only seeds the negotiation until the native size
+   * is known.
+   */
+  uint32_t portal_width;
+  uint32_t portal_height;
+
+  /*
+   * Preferred size of the last negotiation, if it wasn't a known size but
+   * the requested one or the range maximum: a format of that size may just
+   * be the compositor complying, and tells nothing about the native size.
+   */
+  struct spa_rectangle guessed_size;
+
+  /*
+   * Size asked from the compositor, the largest one requested by the
+   * sources, or 0 for the native size. Only changed with the thread loop
+   * locked.
+   */
+  uint32_t requested_width;
+  uint32_t requested_height;
+
+  /* Highest framerate wanted by the sources, also changed with the lock */
+  uint32_t max_framerate;
+
+  /* Smoothest latency mode wanted by the sources, also changed with the lock */
+  obs_pw_latency_mode latency_mode;
+
+  /*
+   * SPA_DATA_* buffer types accepted for the negotiated format, only
+   * changed by the PipeWire thread with frame_lock held
+   */
+  uint32_t buffer_types;
+
+  /*
+   * Async sources hand memory buffers to OBS with obs_source_output_video()
+   * straight from the PipeWire thread, and never render anything themselves.
+   */
+  bool async;
+
+  /* Bumped by the render thread for every frame it uploads or imports */
+  uint64_t frame_serial;
+
+  /* Accessed atomically, as any thread can read them */
+  struct {
+    gint received;
+    gint dropped;
+    gint empty;
+    /* Time from the compositor's presentation time to the upload or output */
+    gint latency[N_LATENCY_BUCKETS];
+  } stats;
+
+  /*
+   * Timeline of the frame being shown, finished when it is replaced, and
+   * the last finished ones. Only touched by the render thread.
+   */
+  obs_pw_frame_timing timing;
+  obs_pw_frame_timing timings[TIMING_WINDOW];
+  uint32_t n_timings;
+  uint32_t next_timing;
+} obs_pw_capture;
+
+struct _obs_pipewire_data
+{
+  obs_pw_session  *session;
+  obs_pw_capture  *capture;
+  uint32_t         pipewire_node;
+
+  obs_source_t    *source;
+  obs_data_t      *settings;
+
+  obs_pw_capture_type capture_type;
+  bool cursor_visible;
+  bool shown;
+  bool async;
+
+  uint32_t max_framerate;
+  obs_pw_latency_mode latency_mode;
+  obs_pw_region region;
+
+  struct {
+    obs_pw_capture_resolution mode;
+    uint32_t scale;
+    uint32_t width;
+    uint32_t height;
+  } resolution;
+
+  /* Rendered frames are new ones, repeated frames were already shown */
+  struct {
+    gint rendered;
+    gint repeated;
+    uint64_t frame_serial;
+    uint64_t last_log;
+  } stats;
+};
+
+typedef struct
+{
+  /* DMA-BUF import of this buffer, created once and reused every frame */
+  obs_pw_texture *texture;
+  uint32_t        n_planes;
+  int64_t         fds[MAX_DMABUF_PLANES];
+  uint32_t        offsets[MAX_DMABUF_PLANES];
+  uint32_t        strides[MAX_DMABUF_PLANES];
+
+  /* Set when the buffer is published, pts is 0 if unknown */
+  uint64_t        sequence;
+  int64_t         pts;
+  uint64_t        dequeued;
+
+  /* Next buffer in the returned_pw_buffers stack */
+  struct pw_buffer *next_returned;
+
+  /* MemFd planes, mapped once for the lifetime of the buffer, or read into
+   * memory on every frame if they aren't sealed against shrinking */
+  struct {
+    void  *ptr;
+    size_t size;
+    bool   copy;
+  } maps[MAX_MEMORY_PLANES];
+} obs_pw_buffer_data;
+
+typedef struct
+{
+  uint32_t spa_format;
+  uint32_t drm_format;
+  /* DMA-BUF modifiers that can be imported, empty if none */
+  GArray  *modifiers;
+  /* Set when importing a DMA-BUF with an implicit modifier failed */
+  bool     implicit_modifier_failed;
+} obs_pw_format_info;
+
+typedef struct
+{
+  enum gs_color_format format;
+  uint32_t             width;
+  uint32_t             height;
+  uint32_t             bytes_per_texel;
+  /* Divides the luma stride when all planes share a single data block */
+  uint32_t             stride_divisor;
+} obs_pw_plane_info;
+
+/*
+ * YUV formats are preferred over RGB for memory buffers, as they take up to
+ * 62% less bandwidth. They are converted by yuv.effect when rendering, and
+ * are never imported as DMA-BUFs. For those, gs_format is the format of the
+ * first plane.
+ */
+static const struct
+{
+  uint32_t             spa_format;
+  uint32_t             drm_format;
+  enum gs_color_format gs_format;
+  const char          *yuv_technique;
+  /* Format of async frames, VIDEO_FORMAT_NONE if OBS has no equivalent */
+  enum video_format    video_format;
+} supported_formats[] =
+{
+  { SPA_VIDEO_FORMAT_NV12, DRM_FORMAT_NV12, GS_R8, "DrawNV12", VIDEO_FORMAT_NV12 },
+  { SPA_VIDEO_FORMAT_I420, DRM_FORMAT_YUV420, GS_R8, "DrawI420", VIDEO_FORMAT_I420 },
+  { SPA_VIDEO_FORMAT_YUY2, DRM_FORMAT_YUYV, GS_R8G8, "DrawYUY2", VIDEO_FORMAT_YUY2 },
+  { SPA_VIDEO_FORMAT_RGBA, DRM_FORMAT_ABGR8888, GS_RGBA, NULL, VIDEO_FORMAT_RGBA },
+  { SPA_VIDEO_FORMAT_RGBx, DRM_FORMAT_XBGR8888, GS_RGBA, NULL, VIDEO_FORMAT_NONE },
+  { SPA_VIDEO_FORMAT_BGRx, DRM_FORMAT_XRGB8888, GS_BGRX, NULL, VIDEO_FORMAT_BGRX },
+  { SPA_VIDEO_FORMAT_BGRA, DRM_FORMAT_ARGB8888, GS_BGRA, NULL, VIDEO_FORMAT_BGRA },
 };
 
+#define N_SUPPORTED_FORMATS G_N_ELEMENTS (supported_formats)
+
 /* auxiliary methods */
 
 static void
-new_request_path (obs_pipewire_data  *data,
-                  char              **out_path,
-                  char              **out_token)
+new_request_path (obs_pw_session  *session,
+                  char           **out_path,
+                  char           **out_token)
 {
   static uint32_t request_token_count = 0;
 
@@ -102,13 +539,13 @@ new_request_path (obs_pipewire_data  *data,
     *out_token = g_strdup_printf ("obs%u", request_token_count);
 
   if (out_path)
-    *out_path = g_strdup_printf (REQUEST_PATH, data->sender_name, request_token_count);
+    *out_path = g_strdup_printf (REQUEST_PATH, session->sender_name, request_token_count);
 }
 
 static void
-new_session_path (obs_pipewire_data  *data,
-                  char              **out_path,
-                  char              **out_token)
+new_session_path (obs_pw_session  *session,
+                  char           **out_path,
+                  char           **out_token)
 {
   static uint32_t session_token_count = 0;
 
@@ -118,15 +555,15 @@ new_session_path (obs_pipewire_data  *data,
     *out_token = g_strdup_printf ("obs%u", session_token_count);
 
   if (out_path)
-    *out_path = g_strdup_printf (SESSION_PATH, data->sender_name, session_token_count);
+    *out_path = g_strdup_printf (SESSION_PATH, session->sender_name, session_token_count);
 }
 
 typedef struct
 {
-  obs_pipewire_data *xdg;
-  char              *request_path;
-  guint              signal_id;
-  gulong             cancelled_id;
+  obs_pw_session *session;
+  char           *request_path;
+  guint           signal_id;
+  gulong          cancelled_id;
 } dbus_call_data;
 
 static void
@@ -137,7 +574,7 @@ on_cancelled_cb (GCancellable *cancellable,
 
   blog (LOG_INFO, "[OBS XDG] Screencast session cancelled");
 
-  g_dbus_connection_call (call->xdg->connection,
+  g_dbus_connection_call (call->session->connection,
                           "org.freedesktop.portal.Desktop",
                           call->request_path,
                           "org.freedesktop.portal.Request",
@@ -150,17 +587,17 @@ on_cancelled_cb (GCancellable *cancellable,
 }
 
 static dbus_call_data*
-subscribe_to_signal (obs_pipewire_data   *xdg,
+subscribe_to_signal (obs_pw_session      *session,
                      const char          *path,
                      GDBusSignalCallback  callback)
 {
   dbus_call_data *call;
 
   call = g_new0 (dbus_call_data, 1);
-  call->xdg = xdg;
+  call->session = session;
   call->request_path = g_strdup (path);
-  call->cancelled_id = g_signal_connect (xdg->cancellable, "cancelled", G_CALLBACK (on_cancelled_cb), call);
-  call->signal_id = g_dbus_connection_signal_subscribe (xdg->connection,
+  call->cancelled_id = g_signal_connect (session->cancellable, "cancelled", G_CALLBACK (on_cancelled_cb), call);
+  call->signal_id = g_dbus_connection_signal_subscribe (session->connection,
                                                         "org.freedesktop.portal.Desktop",
                                                         "org.freedesktop.portal.Request",
                                                         "Response",
@@ -181,340 +618,2352 @@ dbus_call_data_free (dbus_call_data *call)
     return;
 
   if (call->signal_id)
-    g_dbus_connection_signal_unsubscribe (call->xdg->connection, call->signal_id);
+    g_dbus_connection_signal_unsubscribe (call->session->connection, call->signal_id);
 
   if (call->cancelled_id > 0)
-    g_signal_handler_disconnect (call->xdg->cancellable, call->cancelled_id);
+    g_signal_handler_disconnect (call->session->cancellable, call->cancelled_id);
 
   g_clear_pointer (&call->request_path, g_free);
   g_free (call);
 }
 
+/*
+ * Gives a buffer back to the compositor from the render thread, or from a
+ * PipeWire callback, with frame_lock held. The PipeWire thread is woken up
+ * only when the stack was empty, otherwise a drain is already due.
+ */
 static void
-maybe_queue_buffer (obs_pipewire_data *xdg)
+return_buffer (obs_pw_capture    *capture,
+               struct pw_buffer  *b)
 {
-  if (xdg->current_pw_buffer)
+  obs_pw_buffer_data *buffer_data = b->user_data;
+  struct pw_buffer *head;
+
+  do
     {
-      pw_stream_queue_buffer (xdg->stream, xdg->current_pw_buffer);
-      xdg->current_pw_buffer = NULL;
+      head = g_atomic_pointer_get (&capture->returned_pw_buffers);
+      buffer_data->next_returned = head;
     }
+  while (!g_atomic_pointer_compare_and_exchange (&capture->returned_pw_buffers, head, b));
+
+  if (!head && capture->requeue)
+    pw_loop_signal_event (pw_thread_loop_get_loop (capture->thread_loop), capture->requeue);
 }
 
+/* Called from the PipeWire thread, or with the thread loop locked */
 static void
-teardown_pipewire (obs_pipewire_data *xdg)
+drain_returned_buffers (obs_pw_capture *capture)
 {
-  maybe_queue_buffer (xdg);
+  struct pw_buffer *b;
 
-  if (xdg->stream)
-    pw_stream_disconnect (xdg->stream);
-  g_clear_pointer (&xdg->stream, pw_stream_destroy);
+  do
+    b = g_atomic_pointer_get (&capture->returned_pw_buffers);
+  while (!g_atomic_pointer_compare_and_exchange (&capture->returned_pw_buffers, b, NULL));
 
-  if (xdg->thread_loop)
-    pw_thread_loop_stop (xdg->thread_loop);
-  g_clear_pointer (&xdg->thread_loop, pw_thread_loop_destroy);
+  while (b)
+    {
+      obs_pw_buffer_data *buffer_data = b->user_data;
+      struct pw_buffer *next = buffer_data->next_returned;
 
-  xdg->negotiated = false;
+      buffer_data->next_returned = NULL;
+      pw_stream_queue_buffer (capture->stream, b);
+      b = next;
+    }
 }
 
 static void
-destroy_session (obs_pipewire_data *xdg)
+maybe_queue_buffer (obs_pw_capture *capture)
 {
-  close(xdg->pipewire_fd);
-
-  if (xdg->session_handle)
+  if (capture->current_pw_buffer)
     {
-      g_dbus_connection_call (xdg->connection,
-                              "org.freedesktop.portal.Desktop",
-                              xdg->session_handle,
-                              "org.freedesktop.portal.Session",
-                              "Close",
-                              NULL,
-                              NULL,
-                              G_DBUS_CALL_FLAGS_NONE,
-                              -1, NULL, NULL, NULL);
-
-      g_clear_pointer (&xdg->session_handle, g_free);
+      return_buffer (capture, capture->current_pw_buffer);
+      capture->current_pw_buffer = NULL;
+      capture->timing.requeued = os_gettime_ns ();
     }
-
-  g_clear_pointer (&xdg->cursor.texture, gs_texture_destroy);
-  g_clear_pointer (&xdg->texture, gs_texture_destroy);
-  g_cancellable_cancel (xdg->cancellable);
-  g_clear_object (&xdg->cancellable);
-  g_clear_object (&xdg->connection);
-  g_clear_object (&xdg->proxy);
-  g_clear_pointer (&xdg->sender_name, g_free);
 }
 
-static inline bool
-has_effective_crop (obs_pipewire_data *xdg)
+static void
+clear_memory_textures (obs_pw_capture *capture)
 {
-  return xdg->crop.valid &&
-         (xdg->crop.x != 0 ||
-          xdg->crop.y != 0 ||
-          xdg->crop.width < xdg->format.info.raw.size.width ||
-          xdg->crop.height < xdg->format.info.raw.size.height);
+  if (capture->texture == capture->memory_textures[0])
+    capture->texture = NULL;
+
+  for (size_t i = 0; i < MAX_MEMORY_PLANES; i++)
+    g_clear_pointer (&capture->memory_textures[i], frame_sink_texture_destroy);
+
+  if (capture->tiles)
+    {
+      for (guint i = 0; i < capture->tiles->len; i++)
+        frame_sink_texture_destroy (g_ptr_array_index (capture->tiles, i));
+      g_clear_pointer (&capture->tiles, g_ptr_array_unref);
+    }
 }
 
-static bool
-spa_pixel_format_to_obs_pixel_format (uint32_t              spa_format,
-                                      enum gs_color_format *out_format)
+static struct pw_buffer *
+exchange_pending_buffer (obs_pw_capture    *capture,
+                         uint32_t           slot,
+                         struct pw_buffer  *b)
 {
-  switch (spa_format)
-    {
-    case SPA_VIDEO_FORMAT_RGBA:
-    case SPA_VIDEO_FORMAT_RGBx:
-      *out_format = GS_RGBA;
-      break;
+  struct pw_buffer *old;
 
-    case SPA_VIDEO_FORMAT_BGRA:
-      *out_format = GS_BGRA;
-      break;
+  do
+    old = g_atomic_pointer_get (&capture->pending_pw_buffers[slot]);
+  while (!g_atomic_pointer_compare_and_exchange (&capture->pending_pw_buffers[slot], old, b));
 
-    case SPA_VIDEO_FORMAT_BGRx:
-      *out_format = GS_BGRX;
-      break;
+  return old;
+}
 
-    default:
-      return false;
+/* Gives back the frames that were never shown, with frame_lock held */
+static void
+clear_frame_queue (obs_pw_capture *capture)
+{
+  for (uint32_t i = 0; i < FRAME_QUEUE_SIZE; i++)
+    {
+      struct pw_buffer *pending = exchange_pending_buffer (capture, i, NULL);
+
+      if (pending)
+        return_buffer (capture, pending);
     }
 
-  return true;
-}
+  for (uint32_t i = 0; i < capture->n_queued_pw_buffers; i++)
+    return_buffer (capture, capture->queued_pw_buffers[i]);
 
-/* ------------------------------------------------- */
+  capture->n_queued_pw_buffers = 0;
+}
 
-static void
-on_process_cb (void *user_data)
+static bool
+acquire_shared_pipewire (obs_pw_session *session)
 {
-  obs_pipewire_data *xdg = user_data;
-  struct spa_meta_cursor *cursor;
-  enum gs_color_format obs_format;
-  struct spa_buffer *buffer;
-  struct pw_buffer *b;
-  bool has_buffer;
+  bool success = true;
 
-  /* Find the most recent buffer */
-  b = NULL;
-  while (true)
+  g_mutex_lock (&shared_pipewire.lock);
+
+  if (shared_pipewire.refcount == 0)
     {
-      struct pw_buffer *aux = pw_stream_dequeue_buffer (xdg->stream);
-      if (!aux)
-        break;
-      if (b)
-        pw_stream_queue_buffer (xdg->stream, b);
-      b = aux;
+      shared_pipewire.thread_loop = pw_thread_loop_new ("PipeWire thread loop", NULL);
+      shared_pipewire.context = pw_context_new (pw_thread_loop_get_loop (shared_pipewire.thread_loop),
+                                                NULL, 0);
+
+      if (pw_thread_loop_start (shared_pipewire.thread_loop) < 0)
+        {
+          blog (LOG_WARNING, "Error starting threaded mainloop");
+          g_clear_pointer (&shared_pipewire.context, pw_context_destroy);
+          g_clear_pointer (&shared_pipewire.thread_loop, pw_thread_loop_destroy);
+          success = false;
+        }
     }
 
-  if (!b)
+  if (success)
     {
-      blog (LOG_DEBUG, "[pipewire] Out of buffers!");
-      return;
+      shared_pipewire.refcount++;
+      session->thread_loop = shared_pipewire.thread_loop;
+      session->context = shared_pipewire.context;
     }
 
-  buffer = b->buffer;
-  has_buffer = buffer->datas[0].chunk->size != 0;
+  g_mutex_unlock (&shared_pipewire.lock);
 
-  obs_enter_graphics ();
+  return success;
+}
 
-  xdg->current_pw_buffer = b;
+/* Must be called without holding the thread loop lock */
+static void
+release_shared_pipewire (obs_pw_session *session)
+{
+  if (!session->thread_loop)
+    return;
 
-  if (!spa_pixel_format_to_obs_pixel_format (xdg->format.info.raw.format,
-                                             &obs_format))
-    {
-      blog (LOG_ERROR, "[pipewire] unsupported buffer format: %d", xdg->format.info.raw.format);
-      goto read_metadata;
-    }
+  session->thread_loop = NULL;
+  session->context = NULL;
 
-  if (!has_buffer)
-    goto read_metadata;
+  g_mutex_lock (&shared_pipewire.lock);
 
-  if (buffer->datas[0].type == SPA_DATA_DmaBuf)
+  g_assert (shared_pipewire.refcount > 0);
+
+  if (--shared_pipewire.refcount == 0)
     {
-      uint32_t offsets[1];
-      uint32_t strides[1];
-      uint64_t modifiers[1];
-      int fds[1];
-
-      blog (LOG_DEBUG, "[pipewire] DMA-BUF info: fd:%ld, stride:%d, offset:%u, size:%dx%d",
-            buffer->datas[0].fd,
-            buffer->datas[0].chunk->stride,
-            buffer->datas[0].chunk->offset,
-            xdg->format.info.raw.size.width,
-            xdg->format.info.raw.size.height);
-
-      fds[0] = buffer->datas[0].fd;
-      offsets[0] = buffer->datas[0].chunk->offset;
-      strides[0] = buffer->datas[0].chunk->stride;
-      modifiers[0] = xdg->format.info.raw.modifier;
-
-      g_clear_pointer (&xdg->texture, gs_texture_destroy);
-      xdg->texture =
-        gs_texture_create_from_dmabuf (xdg->format.info.raw.size.width,
-                                       xdg->format.info.raw.size.height,
-                                       xdg->format.info.raw.format,
-                                       obs_format,
-                                       1,
-                                       fds,
-                                       strides,
-                                       offsets,
-                                       modifiers);
+      pw_thread_loop_stop (shared_pipewire.thread_loop);
+      g_clear_pointer (&shared_pipewire.context, pw_context_destroy);
+      g_clear_pointer (&shared_pipewire.thread_loop, pw_thread_loop_destroy);
     }
-  else
-    {
-      blog (LOG_DEBUG, "[pipewire] Buffer has memory texture");
 
-      g_clear_pointer (&xdg->texture, gs_texture_destroy);
-      xdg->texture =
-        gs_texture_create (xdg->format.info.raw.size.width,
-                           xdg->format.info.raw.size.height,
-                           obs_format,
-                           1,
-                           (const uint8_t **)&buffer->datas[0].data,
-                           GS_DYNAMIC);
-    }
+  g_mutex_unlock (&shared_pipewire.lock);
+}
 
-  /* Video Crop */
-  if (has_buffer)
-    {
-      struct spa_meta_region *region;
+static void
+teardown_pipewire (obs_pw_capture *capture)
+{
+  if (capture->thread_loop)
+    pw_thread_loop_lock (capture->thread_loop);
 
-      region = spa_buffer_find_meta_data (buffer, SPA_META_VideoCrop, sizeof (*region));
-      if (region && spa_meta_region_is_valid (region))
-        {
-          blog (LOG_DEBUG, "[pipewire] Crop Region available (%dx%d+%d+%d)",
-                region->region.position.x,
-                region->region.position.y,
-                region->region.size.width,
-                region->region.size.height);
-
-          xdg->crop.x = region->region.position.x;
-          xdg->crop.y = region->region.position.y;
-          xdg->crop.width = region->region.size.width;
-          xdg->crop.height = region->region.size.height;
-          xdg->crop.valid = true;
-        }
-      else
-        {
-          xdg->crop.valid = false;
-        }
-    }
+  g_mutex_lock (&capture->frame_lock);
 
-read_metadata:
+  clear_frame_queue (capture);
+  maybe_queue_buffer (capture);
+  if (capture->stream)
+    drain_returned_buffers (capture);
 
-  /* Cursor */
-  cursor = spa_buffer_find_meta_data (buffer, SPA_META_Cursor, sizeof (*cursor));
-  xdg->cursor.valid = cursor && spa_meta_cursor_is_valid (cursor);
-  if (xdg->cursor.visible && xdg->cursor.valid)
-    {
-      struct spa_meta_bitmap *bitmap = NULL;
-      enum gs_color_format format;
+  g_mutex_unlock (&capture->frame_lock);
 
-      if (cursor->bitmap_offset)
-        bitmap = SPA_MEMBER (cursor, cursor->bitmap_offset, struct spa_meta_bitmap);
+  if (capture->stream)
+    pw_stream_disconnect (capture->stream);
+  g_clear_pointer (&capture->stream, pw_stream_destroy);
 
-      if (bitmap &&
-          bitmap->size.width > 0 &&
-          bitmap->size.height > 0 &&
-          spa_pixel_format_to_obs_pixel_format (bitmap->format, &format))
-        {
-          const uint8_t *bitmap_data;
-
-          bitmap_data = SPA_MEMBER (bitmap, bitmap->offset, uint8_t);
-          xdg->cursor.hotspot_x = cursor->hotspot.x;
-          xdg->cursor.hotspot_y = cursor->hotspot.y;
-          xdg->cursor.width = bitmap->size.width;
-          xdg->cursor.height = bitmap->size.height;
-
-          g_clear_pointer (&xdg->cursor.texture, gs_texture_destroy);
-          xdg->cursor.texture =
-            gs_texture_create (xdg->cursor.width,
-                               xdg->cursor.height,
-                               format,
-                               1,
-                               &bitmap_data,
-                               GS_DYNAMIC);
-        }
+  if (capture->reneg)
+    {
+      pw_loop_destroy_source (pw_thread_loop_get_loop (capture->thread_loop), capture->reneg);
+      capture->reneg = NULL;
+    }
 
-      xdg->cursor.x = cursor->position.x;
-      xdg->cursor.y = cursor->position.y;
+  if (capture->requeue)
+    {
+      pw_loop_destroy_source (pw_thread_loop_get_loop (capture->thread_loop), capture->requeue);
+      capture->requeue = NULL;
     }
 
-  obs_leave_graphics ();
+  g_mutex_lock (&capture->frame_lock);
+  g_clear_pointer (&capture->format_info, g_array_unref);
+  g_mutex_unlock (&capture->frame_lock);
 
-  /*
-   * Don't immediately queue the buffer now. Instead, wait until the next
-   * call to obs_pipewire_portal_render_video() to queue it back.
-   */
+  if (capture->thread_loop)
+    pw_thread_loop_unlock (capture->thread_loop);
+
+  capture->thread_loop = NULL;
+
+  capture->negotiated = false;
 }
 
 static void
-on_param_changed_cb (void                 *user_data,
-                     uint32_t              id,
-                     const struct spa_pod *param)
+clear_cursor_cache (obs_pw_capture *capture)
 {
-  obs_pipewire_data *xdg = user_data;
-  struct spa_pod_builder pod_builder;
-  const struct spa_pod *params[3];
-  uint8_t params_buffer[1024];
-  int result;
+  for (size_t i = 0; i < CURSOR_CACHE_SIZE; i++)
+    {
+      g_clear_pointer (&capture->cursor.cache[i].texture, frame_sink_texture_destroy);
+      capture->cursor.cache[i] = (obs_pw_cursor_shape) { 0 };
+    }
 
-  if (!param || id != SPA_PARAM_Format)
-    return;
+  capture->cursor.texture = NULL;
+}
 
-  result = spa_format_parse (param,
-                             &xdg->format.media_type,
-                             &xdg->format.media_subtype);
-  if (result < 0)
+/*
+ * Applies the changes the PipeWire thread left for the render thread: a new
+ * format, which the memory textures are sized after, so they are recreated
+ * lazily, and the textures of buffers that were removed. Called with the
+ * sink lock and frame_lock held.
+ */
+static void
+apply_stream_changes (obs_pw_capture *capture)
+{
+  if (capture->format_changed)
+    {
+      capture->format = capture->stream_format;
+      capture->format_changed = false;
+      clear_memory_textures (capture);
+    }
+
+  for (guint i = 0; i < capture->removed_textures->len; i++)
+    {
+      if (capture->texture == g_ptr_array_index (capture->removed_textures, i))
+        capture->texture = NULL;
+    }
+
+  g_ptr_array_set_size (capture->removed_textures, 0);
+}
+
+static void
+destroy_textures (obs_pw_capture *capture)
+{
+  frame_sink_lock ();
+  g_mutex_lock (&capture->frame_lock);
+  apply_stream_changes (capture);
+  g_mutex_unlock (&capture->frame_lock);
+  clear_cursor_cache (capture);
+  g_clear_pointer (&capture->yuv_effect, gs_effect_destroy);
+  clear_memory_textures (capture);
+  capture->texture = NULL;
+  frame_sink_unlock ();
+}
+
+/* The part of the frame the compositor marked as relevant, or all of it */
+static void
+get_view_rect (obs_pw_capture *capture,
+               obs_pw_rect    *out)
+{
+  uint32_t width = capture->format.info.raw.size.width;
+  uint32_t height = capture->format.info.raw.size.height;
+
+  *out = (obs_pw_rect) { 0, 0, width, height };
+
+  if (capture->crop.valid)
+    {
+      out->x = MIN ((uint32_t) MAX (capture->crop.x, 0), width);
+      out->y = MIN ((uint32_t) MAX (capture->crop.y, 0), height);
+      out->width = MIN ((uint32_t) MAX (capture->crop.width, 0), width - out->x);
+      out->height = MIN ((uint32_t) MAX (capture->crop.height, 0), height - out->y);
+    }
+}
+
+/*
+ * Maps a region onto a frame of the given format, scaling it from native
+ * pixels when the compositor sends scaled frames, and clipping it to the
+ * view.
+ */
+static void
+apply_region (obs_pw_capture              *capture,
+              const struct spa_video_info *format,
+              const obs_pw_region         *region,
+              const obs_pw_rect           *view,
+              obs_pw_rect                 *out)
+{
+  uint64_t scale_num = 1, scale_den = 1;
+  uint32_t x, y;
+
+  *out = *view;
+
+  if (!region->enabled)
+    return;
+
+  if (capture->native_width > 0 && capture->native_height > 0)
+    {
+      scale_num = format->info.raw.size.width;
+      scale_den = capture->native_width;
+    }
+
+  x = MIN (region->x * scale_num / scale_den, view->width);
+  y = MIN (region->y * scale_num / scale_den, view->height);
+
+  out->x = view->x + x;
+  out->y = view->y + y;
+  out->width = MIN (MAX (region->width * scale_num / scale_den, 1), view->width - x);
+  out->height = MIN (MAX (region->height * scale_num / scale_den, 1), view->height - y);
+}
+
+/* Chroma planes can only be offset by whole samples */
+static void
+align_rect_to_chroma (obs_pw_rect *rect)
+{
+  uint32_t x = rect->x & ~1u;
+  uint32_t y = rect->y & ~1u;
+
+  rect->width += rect->x - x;
+  rect->height += rect->y - y;
+  rect->x = x;
+  rect->y = y;
+}
+
+static bool
+spa_pixel_format_to_obs_pixel_format (uint32_t              spa_format,
+                                      enum gs_color_format *out_format)
+{
+  for (size_t i = 0; i < N_SUPPORTED_FORMATS; i++)
+    {
+      if (supported_formats[i].spa_format != spa_format)
+        continue;
+
+      *out_format = supported_formats[i].gs_format;
+      return true;
+    }
+
+  return false;
+}
+
+static bool
+spa_pixel_format_to_drm_format (uint32_t  spa_format,
+                                uint32_t *out_format)
+{
+  for (size_t i = 0; i < N_SUPPORTED_FORMATS; i++)
+    {
+      if (supported_formats[i].spa_format != spa_format)
+        continue;
+
+      *out_format = supported_formats[i].drm_format;
+      return true;
+    }
+
+  return false;
+}
+
+static enum video_format
+spa_pixel_format_to_video_format (uint32_t spa_format)
+{
+  for (size_t i = 0; i < N_SUPPORTED_FORMATS; i++)
+    {
+      if (supported_formats[i].spa_format == spa_format)
+        return supported_formats[i].video_format;
+    }
+
+  return VIDEO_FORMAT_NONE;
+}
+
+static const char *
+spa_pixel_format_to_yuv_technique (uint32_t spa_format)
+{
+  for (size_t i = 0; i < N_SUPPORTED_FORMATS; i++)
+    {
+      if (supported_formats[i].spa_format == spa_format)
+        return supported_formats[i].yuv_technique;
+    }
+
+  return NULL;
+}
+
+static inline bool
+is_yuv_format (uint32_t spa_format)
+{
+  return spa_pixel_format_to_yuv_technique (spa_format) != NULL;
+}
+
+static uint32_t
+get_memory_planes (uint32_t              spa_format,
+                   enum gs_color_format  obs_format,
+                   uint32_t              width,
+                   uint32_t              height,
+                   obs_pw_plane_info    *planes)
+{
+  uint32_t chroma_width = (width + 1) / 2;
+  uint32_t chroma_height = (height + 1) / 2;
+
+  switch (spa_format)
+    {
+    case SPA_VIDEO_FORMAT_NV12:
+      planes[0] = (obs_pw_plane_info) { GS_R8, width, height, 1, 1 };
+      planes[1] = (obs_pw_plane_info) { GS_R8G8, chroma_width, chroma_height, 2, 1 };
+      return 2;
+
+    case SPA_VIDEO_FORMAT_I420:
+      planes[0] = (obs_pw_plane_info) { GS_R8, width, height, 1, 1 };
+      planes[1] = (obs_pw_plane_info) { GS_R8, chroma_width, chroma_height, 1, 2 };
+      planes[2] = (obs_pw_plane_info) { GS_R8, chroma_width, chroma_height, 1, 2 };
+      return 3;
+
+    case SPA_VIDEO_FORMAT_YUY2:
+      /* Y0 U Y1 V, uploaded as luma + alternating chroma texels */
+      planes[0] = (obs_pw_plane_info) { GS_R8G8, width, height, 2, 1 };
+      return 1;
+
+    default:
+      planes[0] = (obs_pw_plane_info) { obs_format, width, height, 4, 1 };
+      return 1;
+    }
+}
+
+static void
+clear_format_info (gpointer data)
+{
+  obs_pw_format_info *info = data;
+
+  g_clear_pointer (&info->modifiers, g_array_unref);
+}
+
+static bool
+drm_format_available (uint32_t        drm_format,
+                      const uint32_t *drm_formats,
+                      size_t          n_drm_formats)
+{
+  for (size_t i = 0; i < n_drm_formats; i++)
+    {
+      if (drm_format == drm_formats[i])
+        return true;
+    }
+
+  return false;
+}
+
+static void
+init_format_info (obs_pw_capture *capture)
+{
+  enum gs_dmabuf_flags dmabuf_flags = GS_DMABUF_FLAG_NONE;
+  uint32_t *drm_formats = NULL;
+  size_t n_drm_formats = 0;
+  bool capabilities_queried;
+
+  g_clear_pointer (&capture->format_info, g_array_unref);
+  capture->format_info = g_array_sized_new (FALSE, TRUE, sizeof (obs_pw_format_info), N_SUPPORTED_FORMATS);
+  g_array_set_clear_func (capture->format_info, clear_format_info);
+
+  frame_sink_lock ();
+
+  capabilities_queried = frame_sink_query_dmabuf_capabilities (&dmabuf_flags, &drm_formats, &n_drm_formats);
+
+  for (size_t i = 0; i < N_SUPPORTED_FORMATS; i++)
+    {
+      obs_pw_format_info info;
+
+      info.spa_format = supported_formats[i].spa_format;
+      info.drm_format = supported_formats[i].drm_format;
+      info.modifiers = g_array_new (FALSE, FALSE, sizeof (uint64_t));
+      info.implicit_modifier_failed = false;
+
+      if (capabilities_queried &&
+          !supported_formats[i].yuv_technique &&
+          drm_format_available (info.drm_format, drm_formats, n_drm_formats))
+        {
+          uint64_t *modifiers = NULL;
+          size_t n_modifiers = 0;
+
+          if (frame_sink_query_dmabuf_modifiers (info.drm_format, &modifiers, &n_modifiers))
+            g_array_append_vals (info.modifiers, modifiers, n_modifiers);
+          bfree (modifiers);
+
+          if (dmabuf_flags & GS_DMABUF_FLAG_IMPLICIT_MODIFIERS_SUPPORTED)
+            {
+              uint64_t implicit_modifier = DRM_FORMAT_MOD_INVALID;
+              g_array_append_val (info.modifiers, implicit_modifier);
+            }
+        }
+
+      blog (LOG_DEBUG, "[pipewire] Format %s: %u DMA-BUF modifiers",
+            spa_debug_type_find_name (spa_type_video_format, info.spa_format),
+            info.modifiers->len);
+
+      g_array_append_val (capture->format_info, info);
+    }
+
+  frame_sink_unlock ();
+
+  bfree (drm_formats);
+}
+
+static obs_pw_format_info *
+lookup_format_info (obs_pw_capture *capture,
+                    uint32_t        spa_format)
+{
+  for (guint i = 0; i < capture->format_info->len; i++)
+    {
+      obs_pw_format_info *info = &g_array_index (capture->format_info, obs_pw_format_info, i);
+
+      if (info->spa_format == spa_format)
+        return info;
+    }
+
+  return NULL;
+}
+
+/* Returns whether the modifier was offered for the format */
+static bool
+remove_modifier_from_format (obs_pw_capture    *capture,
+                             uint32_t           spa_format,
+                             uint64_t           modifier)
+{
+  obs_pw_format_info *info = lookup_format_info (capture, spa_format);
+
+  if (!info)
+    return false;
+
+  for (guint j = 0; j < info->modifiers->len; j++)
+    {
+      if (g_array_index (info->modifiers, uint64_t, j) == modifier)
+        {
+          g_array_remove_index (info->modifiers, j);
+          return true;
+        }
+    }
+
+  return false;
+}
+
+/*
+ * Formats negotiated without a modifier accept DMA-BUFs with an implicit
+ * modifier, unless importing one already failed. There is no modifier to
+ * stop offering then, so DMA-BUFs are refused altogether for the format.
+ * Called with frame_lock held.
+ */
+static uint32_t
+filter_buffer_types (obs_pw_capture *capture,
+                     uint32_t        spa_format,
+                     uint32_t        buffer_types)
+{
+  obs_pw_format_info *info;
+
+  if (!(buffer_types & (1 << SPA_DATA_MemPtr)))
+    return buffer_types;
+
+  info = lookup_format_info (capture, spa_format);
+  if (info && info->implicit_modifier_failed)
+    buffer_types &= ~(1 << SPA_DATA_DmaBuf);
+
+  return buffer_types;
+}
+
+static const struct spa_pod *
+build_format (struct spa_pod_builder     *b,
+              uint32_t                    format,
+              const uint64_t             *modifiers,
+              size_t                      n_modifiers,
+              const struct spa_rectangle *size,
+              const struct spa_fraction  *max_framerate)
+{
+  struct spa_pod_frame format_frame;
+
+  spa_pod_builder_push_object (b, &format_frame, SPA_TYPE_OBJECT_Format, SPA_PARAM_EnumFormat);
+  spa_pod_builder_add (b, SPA_FORMAT_mediaType, SPA_POD_Id (SPA_MEDIA_TYPE_video), 0);
+  spa_pod_builder_add (b, SPA_FORMAT_mediaSubtype, SPA_POD_Id (SPA_MEDIA_SUBTYPE_raw), 0);
+  spa_pod_builder_add (b, SPA_FORMAT_VIDEO_format, SPA_POD_Id (format), 0);
+
+  if (n_modifiers > 0)
+    {
+      struct spa_pod_frame modifier_frame;
+
+      /*
+       * Let the compositor pick the modifier it can allocate from the list
+       * of modifiers we can import, instead of fixating on the first one.
+       */
+      spa_pod_builder_prop (b,
+                            SPA_FORMAT_VIDEO_modifier,
+                            SPA_POD_PROP_FLAG_MANDATORY | SPA_POD_PROP_FLAG_DONT_FIXATE);
+      spa_pod_builder_push_choice (b, &modifier_frame, SPA_CHOICE_Enum, 0);
+
+      /* The first value of a choice is the default one */
+      spa_pod_builder_long (b, modifiers[0]);
+      for (size_t i = 0; i < n_modifiers; i++)
+        spa_pod_builder_long (b, modifiers[i]);
+
+      spa_pod_builder_pop (b, &modifier_frame);
+    }
+
+  spa_pod_builder_add (b,
+                       SPA_FORMAT_VIDEO_size, SPA_POD_CHOICE_RANGE_Rectangle (size,
+                                                                              &SPA_RECTANGLE (1, 1),
+                                                                              &SPA_RECTANGLE (MAX_CAPTURE_SIZE,
+                                                                                              MAX_CAPTURE_SIZE)),
+                       SPA_FORMAT_VIDEO_framerate, SPA_POD_CHOICE_RANGE_Fraction (max_framerate,
+                                                                                  &SPA_FRACTION (0, 1),
+                                                                                  &SPA_FRACTION (MAX_FRAMERATE, 1)),
+                       SPA_FORMAT_VIDEO_maxFramerate, SPA_POD_CHOICE_RANGE_Fraction (max_framerate,
+                                                                                     &SPA_FRACTION (0, 1),
+                                                                                     &SPA_FRACTION (MAX_FRAMERATE, 1)),
+                       0);
+
+  return spa_pod_builder_pop (b, &format_frame);
+}
+
+/*
+ * Builds the EnumFormat params: first every format that can be imported as
+ * a DMA-BUF, with its modifiers, then every format again without modifiers
+ * as a fallback for memory buffers. Returns the number of params.
+ */
+static uint32_t
+build_format_params (obs_pw_capture         *capture,
+                     struct spa_pod_builder *b,
+                     const struct spa_pod  **params)
+{
+  struct spa_rectangle size = SPA_RECTANGLE (MAX_CAPTURE_SIZE, MAX_CAPTURE_SIZE);
+  struct spa_fraction max_framerate = SPA_FRACTION (60, 1);
+  uint32_t n_params = 0;
+
+  /*
+   * The preferred size is only a default, as most compositors can't scale
+   * and offer their native size. Offering the whole range keeps those
+   * working, and compositors that can scale fixate on the default. Until
+   * the native size is known, the portal's size is the best guess, and
+   * without it the range maximum, which scaling compositors clamp to the
+   * largest size they produce.
+   */
+  capture->guessed_size = SPA_RECTANGLE (0, 0);
+
+  if (capture->requested_width > 0 && capture->requested_height > 0)
+    {
+      size = SPA_RECTANGLE (MIN (capture->requested_width, MAX_CAPTURE_SIZE),
+                            MIN (capture->requested_height, MAX_CAPTURE_SIZE));
+      capture->guessed_size = size;
+    }
+  else if (capture->native_width > 0 && capture->native_height > 0)
+    {
+      size = SPA_RECTANGLE (MIN (capture->native_width, MAX_CAPTURE_SIZE),
+                            MIN (capture->native_height, MAX_CAPTURE_SIZE));
+    }
+  else if (capture->portal_width > 0 && capture->portal_height > 0)
+    {
+      size = SPA_RECTANGLE (MIN (capture->portal_width, MAX_CAPTURE_SIZE),
+                            MIN (capture->portal_height, MAX_CAPTURE_SIZE));
+    }
+  else
+    {
+      capture->guessed_size = size;
+    }
+
+  /* Same for the framerate: compositors with a fixed rate keep working */
+  if (capture->max_framerate > 0)
+    max_framerate = SPA_FRACTION (capture->max_framerate, 1);
+
+  for (guint i = 0; i < capture->format_info->len; i++)
+    {
+      obs_pw_format_info *info = &g_array_index (capture->format_info, obs_pw_format_info, i);
+      const struct spa_pod *pod;
+
+      if (capture->async || info->modifiers->len == 0)
+        continue;
+
+      pod = build_format (b,
+                          info->spa_format,
+                          (const uint64_t *) info->modifiers->data,
+                          info->modifiers->len,
+                          &size,
+                          &max_framerate);
+      if (pod)
+        params[n_params++] = pod;
+    }
+
+  for (guint i = 0; i < capture->format_info->len; i++)
+    {
+      obs_pw_format_info *info = &g_array_index (capture->format_info, obs_pw_format_info, i);
+      const struct spa_pod *pod;
+
+      if (capture->async && spa_pixel_format_to_video_format (info->spa_format) == VIDEO_FORMAT_NONE)
+        continue;
+
+      pod = build_format (b, info->spa_format, NULL, 0, &size, &max_framerate);
+      if (pod)
+        params[n_params++] = pod;
+    }
+
+  return n_params;
+}
+
+/*
+ * Uploads only the regions listed in the damage metadata of the buffer into
+ * the memory texture. Returns false if the buffer carries no damage metadata,
+ * in which case the whole frame has to be uploaded. An empty damage list
+ * means nothing changed, and nothing is uploaded.
+ */
+static bool
+upload_damaged_regions (obs_pw_capture          *capture,
+                        const struct spa_buffer *buffer,
+                        const uint8_t           *frame,
+                        uint32_t                 stride,
+                        uint32_t                 bpp)
+{
+  struct spa_meta_region *damage;
+  struct spa_meta *meta;
+  const obs_pw_rect *upload = &capture->upload;
+  uint32_t linesize = 0;
+  uint8_t *ptr = NULL;
+  bool mapped = false;
+
+  meta = spa_buffer_find_meta (buffer, SPA_META_VideoDamage);
+  if (!meta)
+    return false;
+
+  spa_meta_for_each (damage, meta)
+    {
+      uint32_t x, y, w, h;
+
+      if (!spa_meta_region_is_valid (damage))
+        break;
+
+      /* Damage is in frame coordinates, the texture only holds the upload area */
+      x = CLAMP (damage->region.position.x, (int64_t) upload->x, (int64_t) upload->x + upload->width);
+      y = CLAMP (damage->region.position.y, (int64_t) upload->y, (int64_t) upload->y + upload->height);
+      w = CLAMP ((int64_t) damage->region.position.x + damage->region.size.width,
+                 (int64_t) x, (int64_t) upload->x + upload->width) - x;
+      h = CLAMP ((int64_t) damage->region.position.y + damage->region.size.height,
+                 (int64_t) y, (int64_t) upload->y + upload->height) - y;
+
+      if (w == 0 || h == 0)
+        continue;
+
+      x -= upload->x;
+      y -= upload->y;
+
+      if (!mapped)
+        {
+          if (!frame_sink_texture_map (capture->memory_textures[0], &ptr, &linesize))
+            return false;
+          mapped = true;
+        }
+
+      for (uint32_t row = y; row < y + h; row++)
+        memcpy (ptr + row * linesize + x * bpp, frame + row * stride + x * bpp, w * bpp);
+    }
+
+  if (mapped)
+    frame_sink_texture_unmap (capture->memory_textures[0]);
+
+  return true;
+}
+
+/* Returns true if the format uses the full 0-255 range */
+static bool
+get_yuv_color_params (obs_pw_capture    *capture,
+                      float              color_matrix[16],
+                      float              color_range_min[3],
+                      float              color_range_max[3])
+{
+  enum video_colorspace colorspace;
+  enum video_range_type range;
+
+  switch (capture->format.info.raw.color_matrix)
+    {
+    case SPA_VIDEO_COLOR_MATRIX_BT601:
+      colorspace = VIDEO_CS_601;
+      break;
+
+    default:
+      colorspace = VIDEO_CS_709;
+      break;
+    }
+
+  if (capture->format.info.raw.color_range == SPA_VIDEO_COLOR_RANGE_0_255)
+    range = VIDEO_RANGE_FULL;
+  else
+    range = VIDEO_RANGE_PARTIAL;
+
+  video_format_get_parameters (colorspace, range, color_matrix, color_range_min, color_range_max);
+
+  return range == VIDEO_RANGE_FULL;
+}
+
+/*
+ * Finds every plane of a memory buffer, either in its own data block, or
+ * packed one after another in the first block.
+ */
+static bool
+locate_memory_planes (obs_pw_capture          *capture,
+                      const struct spa_buffer *buffer,
+                      const obs_pw_plane_info *planes,
+                      uint32_t                 n_planes,
+                      const uint8_t          **out_data,
+                      uint32_t                *out_strides)
+{
+  uint32_t packed_offset = 0;
+
+  for (uint32_t i = 0; i < n_planes; i++)
+    {
+      const struct spa_data *data;
+      uint32_t min_stride;
+      uint32_t offset;
+      uint32_t stride;
+
+      min_stride = planes[i].width * planes[i].bytes_per_texel;
+
+      if (buffer->n_datas >= n_planes)
+        {
+          data = &buffer->datas[i];
+          stride = data->chunk->stride > 0 ? data->chunk->stride : min_stride;
+          offset = data->chunk->offset;
+        }
+      else
+        {
+          data = &buffer->datas[0];
+          stride = data->chunk->stride > 0 ? data->chunk->stride / planes[i].stride_divisor : min_stride;
+          offset = data->chunk->offset + packed_offset;
+          packed_offset += stride * planes[i].height;
+        }
+
+      if (!data->data ||
+          stride < min_stride ||
+          offset + (uint64_t) stride * planes[i].height > data->maxsize)
+        {
+          blog (LOG_ERROR, "[pipewire] Memory buffer too small for %ux%u plane %u (stride: %u, offset: %u)",
+                planes[i].width, planes[i].height, i, stride, offset);
+          return false;
+        }
+
+      out_data[i] = SPA_MEMBER (data->data, offset, const uint8_t);
+      out_strides[i] = stride;
+    }
+
+  return true;
+}
+
+static bool
+create_tiles (obs_pw_capture          *capture,
+              const obs_pw_plane_info *plane)
+{
+  uint32_t columns = (plane->width + TILE_SIZE - 1) / TILE_SIZE;
+  uint32_t rows = (plane->height + TILE_SIZE - 1) / TILE_SIZE;
+
+  capture->tiles = g_ptr_array_new ();
+  capture->n_tile_columns = columns;
+
+  for (uint32_t row = 0; row < rows; row++)
+    {
+      for (uint32_t column = 0; column < columns; column++)
+        {
+          uint32_t width = MIN (TILE_SIZE, plane->width - column * TILE_SIZE);
+          uint32_t height = MIN (TILE_SIZE, plane->height - row * TILE_SIZE);
+          obs_pw_texture *tile;
+
+          tile = frame_sink_texture_create (width, height, plane->format, NULL);
+          if (!tile)
+            {
+              clear_memory_textures (capture);
+              return false;
+            }
+
+          g_ptr_array_add (capture->tiles, tile);
+        }
+    }
+
+  blog (LOG_INFO, "[pipewire] %ux%u frame too large for a single texture, using %ux%u tiles",
+        plane->width, plane->height, columns, rows);
+
+  return true;
+}
+
+static void
+upload_tiles (obs_pw_capture          *capture,
+              const obs_pw_plane_info *plane,
+              const uint8_t           *data,
+              uint32_t                 stride)
+{
+  for (guint i = 0; i < capture->tiles->len; i++)
+    {
+      obs_pw_texture *tile = g_ptr_array_index (capture->tiles, i);
+      uint32_t x = (i % capture->n_tile_columns) * TILE_SIZE;
+      uint32_t y = (i / capture->n_tile_columns) * TILE_SIZE;
+      uint32_t width = frame_sink_texture_get_width (tile);
+      uint32_t height = frame_sink_texture_get_height (tile);
+      uint32_t linesize;
+      uint8_t *ptr;
+
+      if (!frame_sink_texture_map (tile, &ptr, &linesize))
+        continue;
+
+      for (uint32_t row = 0; row < height; row++)
+        {
+          memcpy (ptr + (size_t) row * linesize,
+                  data + (size_t) (y + row) * stride + (size_t) x * plane->bytes_per_texel,
+                  (size_t) width * plane->bytes_per_texel);
+        }
+
+      frame_sink_texture_unmap (tile);
+    }
+}
+
+/*
+ * YUV frames are converted by a single draw of yuv.effect, and can't be
+ * split into tiles. Stop offering them, so that the compositor falls back
+ * to an RGB format, which can.
+ */
+static void
+drop_yuv_formats (obs_pw_capture *capture)
+{
+  for (guint i = capture->format_info->len; i > 0; i--)
+    {
+      obs_pw_format_info *info = &g_array_index (capture->format_info, obs_pw_format_info, i - 1);
+
+      if (is_yuv_format (info->spa_format))
+        g_array_remove_index (capture->format_info, i - 1);
+    }
+
+  blog (LOG_INFO, "[pipewire] YUV frame too large for a single texture, renegotiating");
+
+  pw_loop_signal_event (pw_thread_loop_get_loop (capture->thread_loop), capture->reneg);
+}
+
+/*
+ * Uploads the part of a memory buffer the sources show into the memory
+ * textures, one per plane. They are kept around for as long as the
+ * negotiated format and the upload area don't change, and only the new
+ * frame contents are uploaded into them.
+ */
+static bool
+upload_memory_buffer (obs_pw_capture       *capture,
+                      struct spa_buffer    *buffer,
+                      enum gs_color_format  obs_format)
+{
+  obs_pw_plane_info frame_planes[MAX_MEMORY_PLANES];
+  obs_pw_plane_info planes[MAX_MEMORY_PLANES];
+  const uint8_t *plane_data[MAX_MEMORY_PLANES];
+  uint32_t plane_strides[MAX_MEMORY_PLANES];
+  uint32_t width = capture->format.info.raw.size.width;
+  uint32_t height = capture->format.info.raw.size.height;
+  obs_pw_rect upload, view;
+  bool full_upload;
+  uint32_t n_planes;
+
+  n_planes = get_memory_planes (capture->format.info.raw.format, obs_format, width, height, frame_planes);
+
+  if (!locate_memory_planes (capture, buffer, frame_planes, n_planes, plane_data, plane_strides))
+    {
+      g_atomic_int_set (&capture->damage_lost, TRUE);
+      return false;
+    }
+
+  full_upload = g_atomic_int_compare_and_exchange (&capture->damage_lost, TRUE, FALSE);
+
+  get_view_rect (capture, &view);
+  apply_region (capture, &capture->format, &capture->region, &view, &upload);
+  if (is_yuv_format (capture->format.info.raw.format))
+    align_rect_to_chroma (&upload);
+
+  if (upload.width == 0 || upload.height == 0)
+    return false;
+
+  get_memory_planes (capture->format.info.raw.format, obs_format, upload.width, upload.height, planes);
+
+  for (uint32_t i = 0; i < n_planes; i++)
+    {
+      plane_data[i] += (size_t) (upload.y * frame_planes[i].height / height) * plane_strides[i] +
+                       (size_t) (upload.x * frame_planes[i].width / width) * frame_planes[i].bytes_per_texel;
+    }
+
+  /* The textures are sized after the upload area, and hold stale pixels if it moved */
+  if (upload.width != capture->upload.width || upload.height != capture->upload.height)
+    clear_memory_textures (capture);
+  else if (upload.x != capture->upload.x || upload.y != capture->upload.y)
+    full_upload = true;
+
+  capture->upload = upload;
+
+  if (capture->tiles)
+    {
+      upload_tiles (capture, &planes[0], plane_data[0], plane_strides[0]);
+      return true;
+    }
+
+  for (uint32_t i = 0; i < n_planes; i++)
+    {
+      if (capture->memory_textures[i])
+        continue;
+
+      blog (LOG_DEBUG, "[pipewire] Creating %ux%u memory texture for plane %u",
+            planes[i].width, planes[i].height, i);
+
+      capture->memory_textures[i] = frame_sink_texture_create (planes[i].width,
+                                                               planes[i].height,
+                                                               planes[i].format,
+                                                               NULL);
+      if (!capture->memory_textures[i])
+        {
+          if (planes[i].width <= TILE_SIZE && planes[i].height <= TILE_SIZE)
+            return false;
+
+          if (n_planes > 1 || is_yuv_format (capture->format.info.raw.format))
+            {
+              drop_yuv_formats (capture);
+              return false;
+            }
+
+          if (!create_tiles (capture, &planes[0]))
+            return false;
+
+          upload_tiles (capture, &planes[0], plane_data[0], plane_strides[0]);
+          return true;
+        }
+
+      full_upload = true;
+    }
+
+  /* Damage regions are only tracked for packed formats */
+  if (!full_upload &&
+      n_planes == 1 &&
+      upload_damaged_regions (capture, buffer, plane_data[0], plane_strides[0], planes[0].bytes_per_texel))
+    return true;
+
+  for (uint32_t i = 0; i < n_planes; i++)
+    frame_sink_texture_set_image (capture->memory_textures[i], plane_data[i], plane_strides[i]);
+
+  return true;
+}
+
+static bool
+dmabuf_layout_changed (const obs_pw_buffer_data *buffer_data,
+                       const struct spa_buffer  *buffer,
+                       uint32_t                  n_planes)
+{
+  if (buffer_data->n_planes != n_planes)
+    return true;
+
+  for (uint32_t plane = 0; plane < n_planes; plane++)
+    {
+      if (buffer_data->fds[plane] != buffer->datas[plane].fd ||
+          buffer_data->offsets[plane] != buffer->datas[plane].chunk->offset ||
+          buffer_data->strides[plane] != (uint32_t) buffer->datas[plane].chunk->stride)
+        return true;
+    }
+
+  return false;
+}
+
+/*
+ * Returns the texture for a DMA-BUF backed buffer. The compositor cycles
+ * through a fixed set of buffers, so each of them is imported only once and
+ * the texture is kept around until PipeWire removes the buffer. It is only
+ * imported again if the compositor changed the layout of the planes.
+ */
+static obs_pw_texture *
+import_dmabuf (obs_pw_capture       *capture,
+               struct pw_buffer     *b,
+               enum gs_color_format  obs_format)
+{
+  obs_pw_buffer_data *buffer_data = b->user_data;
+  struct spa_buffer *buffer = b->buffer;
+  uint64_t modifiers[MAX_DMABUF_PLANES];
+  uint32_t offsets[MAX_DMABUF_PLANES];
+  uint32_t strides[MAX_DMABUF_PLANES];
+  int fds[MAX_DMABUF_PLANES];
+  uint32_t drm_format;
+  uint32_t n_planes;
+
+  if (!spa_pixel_format_to_drm_format (capture->format.info.raw.format, &drm_format))
+    return NULL;
+
+  n_planes = buffer->n_datas;
+  if (n_planes == 0 || n_planes > MAX_DMABUF_PLANES)
+    {
+      blog (LOG_ERROR, "[pipewire] Unsupported number of DMA-BUF planes: %u", n_planes);
+      return NULL;
+    }
+
+  if (buffer_data->texture && !dmabuf_layout_changed (buffer_data, buffer, n_planes))
+    return buffer_data->texture;
+
+  for (uint32_t plane = 0; plane < n_planes; plane++)
+    {
+      fds[plane] = buffer->datas[plane].fd;
+      offsets[plane] = buffer->datas[plane].chunk->offset;
+      strides[plane] = buffer->datas[plane].chunk->stride;
+      modifiers[plane] = capture->format.info.raw.modifier;
+
+      blog (LOG_DEBUG, "[pipewire] DMA-BUF plane %u: fd:%d, stride:%u, offset:%u, size:%dx%d",
+            plane,
+            fds[plane],
+            strides[plane],
+            offsets[plane],
+            capture->format.info.raw.size.width,
+            capture->format.info.raw.size.height);
+
+      buffer_data->fds[plane] = buffer->datas[plane].fd;
+      buffer_data->offsets[plane] = offsets[plane];
+      buffer_data->strides[plane] = strides[plane];
+    }
+
+  buffer_data->n_planes = n_planes;
+
+  g_clear_pointer (&buffer_data->texture, frame_sink_texture_destroy);
+  buffer_data->texture =
+    frame_sink_texture_import_dmabuf (capture->format.info.raw.size.width,
+                                      capture->format.info.raw.size.height,
+                                      drm_format,
+                                      obs_format,
+                                      n_planes,
+                                      fds,
+                                      strides,
+                                      offsets,
+                                      modifiers);
+
+  /*
+   * The modifier was advertised as importable but the import failed
+   * anyway. Stop offering it and let the compositor pick another
+   * modifier, or fall back to memory buffers. Formats negotiated without
+   * a modifier stop accepting DMA-BUFs instead. Renegotiating only helps
+   * if something changed, otherwise the same buffers would come back.
+   */
+  if (!buffer_data->texture)
+    {
+      bool changed;
+
+      if (capture->buffer_types & (1 << SPA_DATA_MemPtr))
+        {
+          obs_pw_format_info *info = lookup_format_info (capture, capture->format.info.raw.format);
+
+          changed = info && !info->implicit_modifier_failed;
+          if (info)
+            info->implicit_modifier_failed = true;
+        }
+      else
+        {
+          changed = remove_modifier_from_format (capture, capture->format.info.raw.format, modifiers[0]);
+        }
+
+      if (changed)
+        {
+          blog (LOG_WARNING, "[pipewire] Failed to import DMA-BUF with modifier 0x%" PRIx64 ", renegotiating",
+                modifiers[0]);
+          pw_loop_signal_event (pw_thread_loop_get_loop (capture->thread_loop), capture->reneg);
+        }
+    }
+
+  return buffer_data->texture;
+}
+
+/* ------------------------------------------------- */
+
+/* FNV-1a over the visible pixels, skipping any row padding */
+static uint64_t
+hash_cursor_bitmap (const uint8_t *data,
+                    uint32_t       width,
+                    uint32_t       height,
+                    uint32_t       stride)
+{
+  uint64_t hash = 0xcbf29ce484222325ull;
+
+  for (uint32_t y = 0; y < height; y++)
+    {
+      const uint8_t *row = data + (size_t) y * stride;
+
+      for (uint32_t x = 0; x < width * 4; x++)
+        hash = (hash ^ row[x]) * 0x100000001b3ull;
+    }
+
+  return hash;
+}
+
+/*
+ * Returns the texture of a cursor bitmap, only creating it when the shape
+ * wasn't seen recently. Compositors resend the same handful of shapes over
+ * and over, and position-only updates carry no bitmap at all.
+ */
+static obs_pw_texture *
+lookup_cursor_texture (obs_pw_capture                *capture,
+                       const struct spa_meta_cursor  *cursor,
+                       const struct spa_meta_bitmap  *bitmap,
+                       enum gs_color_format           format)
+{
+  obs_pw_cursor_shape *shape = NULL;
+  const uint8_t *bitmap_data;
+  uint32_t stride;
+  uint64_t hash;
+
+  bitmap_data = SPA_MEMBER (bitmap, bitmap->offset, uint8_t);
+  stride = bitmap->stride > 0 ? (uint32_t) bitmap->stride : bitmap->size.width * 4;
+  hash = hash_cursor_bitmap (bitmap_data, bitmap->size.width, bitmap->size.height, stride);
+
+  for (size_t i = 0; i < CURSOR_CACHE_SIZE; i++)
+    {
+      obs_pw_cursor_shape *entry = &capture->cursor.cache[i];
+
+      if (entry->texture &&
+          entry->id == cursor->id &&
+          entry->hash == hash &&
+          entry->width == bitmap->size.width &&
+          entry->height == bitmap->size.height &&
+          entry->format == format)
+        {
+          entry->last_used = ++capture->cursor.serial;
+          return entry->texture;
+        }
+
+      if (!shape || entry->last_used < shape->last_used)
+        shape = entry;
+    }
+
+  g_clear_pointer (&shape->texture, frame_sink_texture_destroy);
+
+  shape->id = cursor->id;
+  shape->hash = hash;
+  shape->width = bitmap->size.width;
+  shape->height = bitmap->size.height;
+  shape->format = format;
+  shape->last_used = ++capture->cursor.serial;
+
+  if (stride == bitmap->size.width * 4)
+    {
+      shape->texture = frame_sink_texture_create (shape->width, shape->height, format, bitmap_data);
+    }
+  else
+    {
+      shape->texture = frame_sink_texture_create (shape->width, shape->height, format, NULL);
+      if (shape->texture)
+        frame_sink_texture_set_image (shape->texture, bitmap_data, stride);
+    }
+
+  return shape->texture;
+}
+
+static void
+write_trace_event (const char *name,
+                   uint32_t    node,
+                   uint64_t    sequence,
+                   uint64_t    start,
+                   uint64_t    end)
+{
+  if (start == 0 || end < start)
+    return;
+
+  fprintf (trace_file,
+           "{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %u, "
+           "\"ts\": %.3f, \"dur\": %.3f, \"args\": {\"frame\": %" PRIu64 "}},\n",
+           name, node, start / 1000.0, (end - start) / 1000.0, sequence);
+}
+
+/* Stores the timeline of the frame that was shown until now */
+static void
+finish_frame_timing (obs_pw_capture *capture)
+{
+  obs_pw_frame_timing *timing = &capture->timing;
+
+  if (timing->ready == 0)
+    return;
+
+  if (trace_file)
+    {
+      write_trace_event ("delivery", capture->node, timing->sequence, timing->pts, timing->dequeued);
+      write_trace_event ("upload", capture->node, timing->sequence, timing->dequeued, timing->ready);
+      write_trace_event ("display", capture->node, timing->sequence, timing->ready, timing->rendered);
+      write_trace_event ("held", capture->node, timing->sequence, timing->dequeued, timing->requeued);
+    }
+
+  /* Only complete timelines make it into the percentiles */
+  if (timing->pts > 0 && timing->rendered > 0)
+    {
+      capture->timings[capture->next_timing] = *timing;
+      capture->next_timing = (capture->next_timing + 1) % TIMING_WINDOW;
+      capture->n_timings = MIN (capture->n_timings + 1, TIMING_WINDOW);
+    }
+
+  *timing = (obs_pw_frame_timing) { 0 };
+}
+
+static int
+compare_durations (const void *a,
+                   const void *b)
+{
+  uint64_t duration_a = *(const uint64_t *) a;
+  uint64_t duration_b = *(const uint64_t *) b;
+
+  return (duration_a > duration_b) - (duration_a < duration_b);
+}
+
+static const char *timing_steps[] = { "delivery", "upload", "display", "total" };
+
+static uint64_t
+get_step_duration (const obs_pw_frame_timing *timing,
+                   size_t                     step)
+{
+  uint64_t start, end;
+
+  switch (step)
+    {
+    case 0:
+      start = timing->pts;
+      end = timing->dequeued;
+      break;
+
+    case 1:
+      start = timing->dequeued;
+      end = timing->ready;
+      break;
+
+    case 2:
+      start = timing->ready;
+      end = timing->rendered;
+      break;
+
+    default:
+      start = timing->pts;
+      end = timing->rendered;
+      break;
+    }
+
+  return end > start ? end - start : 0;
+}
+
+/*
+ * The 50th, 95th and 99th percentiles of each step of the recent frames, in
+ * milliseconds, or NULL if there are none.
+ */
+static char *
+format_frame_timings (obs_pw_capture *capture)
+{
+  uint64_t durations[TIMING_WINDOW];
+  uint32_t n = capture->n_timings;
+  GString *string;
+
+  if (n == 0)
+    return NULL;
+
+  string = g_string_new (NULL);
+
+  for (size_t step = 0; step < G_N_ELEMENTS (timing_steps); step++)
+    {
+      for (uint32_t i = 0; i < n; i++)
+        durations[i] = get_step_duration (&capture->timings[i], step);
+
+      qsort (durations, n, sizeof (uint64_t), compare_durations);
+
+      g_string_append_printf (string, "%s%s p50 %.2f / p95 %.2f / p99 %.2f ms",
+                              step > 0 ? ", " : "",
+                              timing_steps[step],
+                              durations[n * 50 / 100] / 1e6,
+                              durations[n * 95 / 100] / 1e6,
+                              durations[n * 99 / 100] / 1e6);
+    }
+
+  return g_string_free (string, FALSE);
+}
+
+/*
+ * The compositor's presentation time of the buffer, or 0 if it is missing or
+ * obviously on another clock than the monotonic clock OBS uses.
+ */
+static int64_t
+get_presentation_time (const struct spa_buffer *buffer,
+                       uint64_t                 now)
+{
+  struct spa_meta_header *header;
+
+  header = spa_buffer_find_meta_data (buffer, SPA_META_Header, sizeof (*header));
+  if (!header || header->pts <= 0 || llabs ((int64_t) now - header->pts) >= NSEC_PER_SEC)
+    return 0;
+
+  return header->pts;
+}
+
+static char *
+format_latency_histogram (obs_pw_capture *capture)
+{
+  GString *string = g_string_new (NULL);
+
+  for (size_t i = 0; i < N_LATENCY_BUCKETS; i++)
+    {
+      gint count = g_atomic_int_get (&capture->stats.latency[i]);
+
+      if (i < G_N_ELEMENTS (latency_buckets_ms))
+        g_string_append_printf (string, "%s<%ums: %d", i > 0 ? ", " : "", latency_buckets_ms[i], count);
+      else
+        g_string_append_printf (string, ", more: %d", count);
+    }
+
+  return g_string_free (string, FALSE);
+}
+
+/* Periodically logs the counters, to diagnose stutter from the log alone */
+static void
+maybe_log_stats (obs_pw_capture    *capture,
+                 obs_pipewire_data *xdg,
+                 uint64_t           now)
+{
+  g_autofree char *timings = NULL;
+  g_autofree char *latency = NULL;
+
+  if (xdg->stats.last_log == 0)
+    xdg->stats.last_log = now;
+
+  if (now - xdg->stats.last_log < STATS_LOG_INTERVAL)
+    return;
+
+  xdg->stats.last_log = now;
+  latency = format_latency_histogram (capture);
+  timings = format_frame_timings (capture);
+
+  blog (LOG_INFO, "[pipewire] Source '%s': %d frames received, %d dropped, %d empty, "
+        "%d rendered, %d repeated, latency %s",
+        obs_source_get_name (xdg->source),
+        g_atomic_int_get (&capture->stats.received),
+        g_atomic_int_get (&capture->stats.dropped),
+        g_atomic_int_get (&capture->stats.empty),
+        g_atomic_int_get (&xdg->stats.rendered),
+        g_atomic_int_get (&xdg->stats.repeated),
+        latency);
+
+  if (timings)
+    blog (LOG_INFO, "[pipewire] Source '%s': %s", obs_source_get_name (xdg->source), timings);
+
+  if (frame_sink_get () == &obs_pw_null_frame_sink)
+    {
+      obs_pw_null_sink_stats sink_stats;
+
+      obs_pw_null_frame_sink_get_stats (&sink_stats);
+      blog (LOG_INFO, "[pipewire] Null frame sink: %" PRIu64 " textures created, %" PRIu64 " DMA-BUF imports, "
+            "%" PRIu64 " uploads, %" PRIu64 " MiB uploaded",
+            sink_stats.textures_created,
+            sink_stats.dmabuf_imports,
+            sink_stats.uploads,
+            sink_stats.bytes_uploaded / (1024 * 1024));
+    }
+}
+
+static void
+record_latency (obs_pw_capture          *capture,
+                const struct spa_buffer *buffer,
+                uint64_t                 now)
+{
+  uint64_t latency_ms;
+  size_t bucket;
+  int64_t pts;
+
+  pts = get_presentation_time (buffer, now);
+  if (pts == 0)
+    return;
+
+  latency_ms = now > (uint64_t) pts ? (now - pts) / 1000000 : 0;
+
+  for (bucket = 0; bucket < G_N_ELEMENTS (latency_buckets_ms); bucket++)
+    {
+      if (latency_ms < latency_buckets_ms[bucket])
+        break;
+    }
+
+  g_atomic_int_inc (&capture->stats.latency[bucket]);
+}
+
+static void
+read_crop_metadata (obs_pw_capture     *capture,
+                    struct spa_buffer  *buffer)
+{
+  struct spa_meta_region *region;
+
+  region = spa_buffer_find_meta_data (buffer, SPA_META_VideoCrop, sizeof (*region));
+  if (region && spa_meta_region_is_valid (region))
+    {
+      blog (LOG_DEBUG, "[pipewire] Crop Region available (%dx%d+%d+%d)",
+            region->region.position.x,
+            region->region.position.y,
+            region->region.size.width,
+            region->region.size.height);
+
+      capture->crop.x = region->region.position.x;
+      capture->crop.y = region->region.position.y;
+      capture->crop.width = region->region.size.width;
+      capture->crop.height = region->region.size.height;
+      capture->crop.valid = true;
+    }
+  else
+    {
+      capture->crop.valid = false;
+    }
+}
+
+static void
+read_cursor_metadata (obs_pw_capture     *capture,
+                      struct spa_buffer  *buffer)
+{
+  struct spa_meta_cursor *cursor;
+
+  cursor = spa_buffer_find_meta_data (buffer, SPA_META_Cursor, sizeof (*cursor));
+  capture->cursor.valid = cursor && spa_meta_cursor_is_valid (cursor);
+  if (capture->cursor.valid)
+    {
+      struct spa_meta_bitmap *bitmap = NULL;
+      enum gs_color_format format;
+
+      if (cursor->bitmap_offset)
+        bitmap = SPA_MEMBER (cursor, cursor->bitmap_offset, struct spa_meta_bitmap);
+
+      if (bitmap &&
+          bitmap->size.width > 0 &&
+          bitmap->size.height > 0 &&
+          !is_yuv_format (bitmap->format) &&
+          spa_pixel_format_to_obs_pixel_format (bitmap->format, &format))
+        {
+          capture->cursor.hotspot_x = cursor->hotspot.x;
+          capture->cursor.hotspot_y = cursor->hotspot.y;
+          capture->cursor.width = bitmap->size.width;
+          capture->cursor.height = bitmap->size.height;
+          capture->cursor.texture = lookup_cursor_texture (capture, cursor, bitmap, format);
+        }
+
+      capture->cursor.x = cursor->position.x;
+      capture->cursor.y = cursor->position.y;
+    }
+}
+
+static void
+process_buffer (obs_pw_capture    *capture,
+                struct pw_buffer  *b)
+{
+  obs_pw_buffer_data *buffer_data;
+  enum gs_color_format obs_format;
+  struct spa_buffer *buffer;
+
+  buffer = b->buffer;
+
+  /*
+   * Cursor-only updates carry metadata but no frame. The frame shown, and
+   * the buffer backing it, stay as they are, and the update goes back to
+   * the compositor right away.
+   */
+  if (buffer->datas[0].chunk->size == 0)
+    {
+      read_crop_metadata (capture, buffer);
+      read_cursor_metadata (capture, buffer);
+      return_buffer (capture, b);
+      return;
+    }
+
+  /* The frame being replaced is stale now, give it back to the compositor */
+  maybe_queue_buffer (capture);
+  finish_frame_timing (capture);
+
+  buffer_data = b->user_data;
+  capture->current_pw_buffer = b;
+  capture->current_pts = buffer_data->pts;
+  capture->timing.sequence = buffer_data->sequence;
+  capture->timing.pts = buffer_data->pts;
+  capture->timing.dequeued = buffer_data->dequeued;
+
+  if (!spa_pixel_format_to_obs_pixel_format (capture->format.info.raw.format,
+                                             &obs_format))
+    {
+      blog (LOG_ERROR, "[pipewire] unsupported buffer format: %d", capture->format.info.raw.format);
+      goto read_metadata;
+    }
+
+  /* Video Crop, read first as only the cropped area is uploaded */
+  read_crop_metadata (capture, buffer);
+
+  if (buffer->datas[0].type == SPA_DATA_DmaBuf)
+    {
+      if (is_yuv_format (capture->format.info.raw.format))
+        {
+          blog (LOG_ERROR, "[pipewire] YUV formats can't be imported as DMA-BUF");
+          goto read_metadata;
+        }
+
+      capture->texture = import_dmabuf (capture, b, obs_format);
+    }
+  else if (upload_memory_buffer (capture, buffer, obs_format))
+    {
+      capture->texture = capture->memory_textures[0];
+    }
+
+  capture->frame_serial++;
+  capture->timing.ready = os_gettime_ns ();
+  record_latency (capture, buffer, capture->timing.ready);
+
+read_metadata:
+  read_cursor_metadata (capture, buffer);
+
+  /*
+   * Memory buffers were copied into the texture and can go back to the
+   * compositor right away. Imported DMA-BUFs are only valid while the
+   * buffer is held, so keep those until a newer frame replaces them.
+   */
+  if (buffer->datas[0].type != SPA_DATA_DmaBuf)
+    maybe_queue_buffer (capture);
+}
+
+/*
+ * Number of frames that may wait to be shown, so that the frames held by OBS
+ * never exhaust the pool. Up to that many frames are published between two
+ * renders, and as many are collected in the queue, next to the current
+ * frame. That is at most 2 * depth + 1 buffers, leaving the compositor at
+ * least one to draw into.
+ *
+ * With fewer than 4 buffers the depth is 0: a single frame is published,
+ * there is no queue, and the newest frame is shown right away, so OBS holds
+ * at most two buffers, which the minimum pool size leaves room for.
+ */
+static uint32_t
+get_hold_depth (obs_pw_capture *capture)
+{
+  int n_buffers = g_atomic_int_get (&capture->n_buffers);
+
+  return CLAMP ((n_buffers - 2) / 2, 0, FRAME_QUEUE_SIZE);
+}
+
+static void
+drop_queued_frames (obs_pw_capture *capture,
+                    uint32_t        n_frames)
+{
+  for (uint32_t i = 0; i < n_frames; i++)
+    return_buffer (capture, capture->queued_pw_buffers[i]);
+
+  memmove (&capture->queued_pw_buffers[0], &capture->queued_pw_buffers[n_frames],
+           (capture->n_queued_pw_buffers - n_frames) * sizeof (struct pw_buffer *));
+  capture->n_queued_pw_buffers -= n_frames;
+
+  if (n_frames > 0)
+    {
+      g_atomic_int_set (&capture->damage_lost, TRUE);
+      g_atomic_int_add (&capture->stats.dropped, n_frames);
+    }
+}
+
+/*
+ * Collects the frames published by the PipeWire thread, and picks the one
+ * whose presentation time is the closest to the video tick being rendered,
+ * rather than the one that arrived last. Compositors running at a rate that
+ * doesn't divide the canvas rate, or with a variable rate, otherwise cause
+ * judder. Frames newer than the picked one are kept for the next ticks, older
+ * ones go back to the compositor. Returns NULL to keep the current frame.
+ */
+static struct pw_buffer *
+select_frame (obs_pw_capture *capture)
+{
+  uint64_t target = obs_get_video_frame_time ();
+  uint32_t hold_depth = get_hold_depth (capture);
+  uint32_t capacity = MAX (hold_depth, 1);
+  int64_t best_distance = INT64_MAX;
+  bool have_pts = target > 0;
+  int32_t best = -1;
+  struct pw_buffer *b;
+
+  /* The pool may have shrunk since the last render */
+  if (capture->n_queued_pw_buffers >= capacity)
+    drop_queued_frames (capture, capture->n_queued_pw_buffers - capacity + 1);
+
+  for (uint32_t i = 0; i < FRAME_QUEUE_SIZE; i++)
+    {
+      uint32_t position;
+
+      b = exchange_pending_buffer (capture, i, NULL);
+      if (!b)
+        continue;
+
+      if (capture->n_queued_pw_buffers == capacity)
+        drop_queued_frames (capture, 1);
+
+      /* Slots are reused round-robin, keep the queue in arrival order */
+      position = capture->n_queued_pw_buffers;
+      while (position > 0 &&
+             ((obs_pw_buffer_data *) capture->queued_pw_buffers[position - 1]->user_data)->sequence >
+             ((obs_pw_buffer_data *) b->user_data)->sequence)
+        {
+          capture->queued_pw_buffers[position] = capture->queued_pw_buffers[position - 1];
+          position--;
+        }
+
+      capture->queued_pw_buffers[position] = b;
+      capture->n_queued_pw_buffers++;
+    }
+
+  if (capture->n_queued_pw_buffers == 0)
+    return NULL;
+
+  for (uint32_t i = 0; i < capture->n_queued_pw_buffers; i++)
+    have_pts &= ((obs_pw_buffer_data *) capture->queued_pw_buffers[i]->user_data)->pts > 0;
+
+  /*
+   * Without presentation times, the newest frame is the best guess. Without
+   * a queue, newer frames can't be kept for later ticks, so it is the only
+   * choice.
+   */
+  if (!have_pts || hold_depth == 0)
+    {
+      best = capture->n_queued_pw_buffers - 1;
+    }
+  else
+    {
+      if (capture->current_pts > 0)
+        best_distance = llabs (capture->current_pts - (int64_t) target);
+
+      for (uint32_t i = 0; i < capture->n_queued_pw_buffers; i++)
+        {
+          obs_pw_buffer_data *buffer_data = capture->queued_pw_buffers[i]->user_data;
+          int64_t distance = llabs (buffer_data->pts - (int64_t) target);
+
+          if (distance <= best_distance)
+            {
+              best_distance = distance;
+              best = i;
+            }
+        }
+
+      if (best < 0)
+        return NULL;
+    }
+
+  drop_queued_frames (capture, best);
+
+  b = capture->queued_pw_buffers[0];
+  capture->n_queued_pw_buffers--;
+  memmove (&capture->queued_pw_buffers[0], &capture->queued_pw_buffers[1],
+           capture->n_queued_pw_buffers * sizeof (struct pw_buffer *));
+
+  return b;
+}
+
+/*
+ * Wraps a memory buffer in an async frame for each source, applying the crop
+ * metadata and the region of the source by offsetting into the planes. OBS
+ * copies the frame into its own cache in obs_source_output_video(), so only
+ * the region is copied, and the buffer can be queued back right after.
+ */
+static void
+output_async_frame (obs_pw_capture    *capture,
+                    struct pw_buffer  *b)
+{
+  struct obs_source_frame frame = { 0 };
+  obs_pw_plane_info planes[MAX_MEMORY_PLANES];
+  const uint8_t *plane_data[MAX_MEMORY_PLANES];
+  uint32_t plane_strides[MAX_MEMORY_PLANES];
+  struct spa_buffer *buffer = b->buffer;
+  struct spa_meta_region *region;
+  enum gs_color_format obs_format;
+  uint32_t width, height;
+  obs_pw_rect view;
+  uint32_t n_planes;
+  uint64_t now;
+  int64_t pts;
+
+  if (buffer->datas[0].chunk->size == 0)
     return;
 
-  if (xdg->format.media_type != SPA_MEDIA_TYPE_video ||
-      xdg->format.media_subtype != SPA_MEDIA_SUBTYPE_raw)
+  if (buffer->datas[0].type == SPA_DATA_DmaBuf)
+    {
+      blog (LOG_ERROR, "[pipewire] DMA-BUF buffers can't be used by async sources");
+      return;
+    }
+
+  frame.format = spa_pixel_format_to_video_format (capture->stream_format.info.raw.format);
+  if (frame.format == VIDEO_FORMAT_NONE ||
+      !spa_pixel_format_to_obs_pixel_format (capture->stream_format.info.raw.format, &obs_format))
+    {
+      blog (LOG_ERROR, "[pipewire] unsupported buffer format: %d", capture->stream_format.info.raw.format);
+      return;
+    }
+
+  width = capture->stream_format.info.raw.size.width;
+  height = capture->stream_format.info.raw.size.height;
+
+  n_planes = get_memory_planes (capture->stream_format.info.raw.format, obs_format, width, height, planes);
+  if (!locate_memory_planes (capture, buffer, planes, n_planes, plane_data, plane_strides))
     return;
 
-  spa_format_video_raw_parse (param, &xdg->format.info.raw);
+  view = (obs_pw_rect) { 0, 0, width, height };
 
-  blog (LOG_DEBUG, "[pipewire] Negotiated format:");
+  region = spa_buffer_find_meta_data (buffer, SPA_META_VideoCrop, sizeof (*region));
+  if (region && spa_meta_region_is_valid (region))
+    {
+      view.x = MIN ((uint32_t) MAX (region->region.position.x, 0), width);
+      view.y = MIN ((uint32_t) MAX (region->region.position.y, 0), height);
+      view.width = MIN (region->region.size.width, width - view.x);
+      view.height = MIN (region->region.size.height, height - view.y);
+    }
 
-  blog (LOG_DEBUG, "[pipewire]     Format: %d (%s)",
-        xdg->format.info.raw.format,
-        spa_debug_type_find_name(spa_type_video_format,
-                                 xdg->format.info.raw.format));
+  if (is_yuv_format (capture->stream_format.info.raw.format))
+    {
+      frame.full_range = get_yuv_color_params (capture,
+                                               frame.color_matrix,
+                                               frame.color_range_min,
+                                               frame.color_range_max);
+    }
+
+  /*
+   * Prefer the compositor's presentation time, which shares the monotonic
+   * clock with OBS, unless it is missing or obviously on another clock.
+   */
+  now = os_gettime_ns ();
+  pts = get_presentation_time (buffer, now);
+  frame.timestamp = pts > 0 ? (uint64_t) pts : now;
+
+  record_latency (capture, buffer, now);
+
+  for (guint i = 0; i < capture->sources->len; i++)
+    {
+      obs_pipewire_data *xdg = g_ptr_array_index (capture->sources, i);
+      obs_pw_rect rect;
+
+      apply_region (capture, &capture->stream_format, &xdg->region, &view, &rect);
+      if (is_yuv_format (capture->stream_format.info.raw.format))
+        align_rect_to_chroma (&rect);
+
+      if (rect.width == 0 || rect.height == 0)
+        continue;
+
+      for (uint32_t j = 0; j < n_planes; j++)
+        {
+          uint32_t plane_x = rect.x * planes[j].width / width;
+          uint32_t plane_y = rect.y * planes[j].height / height;
+
+          frame.data[j] = (uint8_t *) plane_data[j] +
+                          (size_t) plane_y * plane_strides[j] +
+                          (size_t) plane_x * planes[j].bytes_per_texel;
+          frame.linesize[j] = plane_strides[j];
+        }
+
+      frame.width = rect.width;
+      frame.height = rect.height;
+
+      obs_source_output_video (xdg->source, &frame);
+
+      g_atomic_int_inc (&xdg->stats.rendered);
+      maybe_log_stats (capture, xdg, now);
+    }
+}
+
+/*
+ * Maps a MemFd plane read-only, pointing the plane data at the mapping so it
+ * is uploaded from like any memory buffer. A memfd that isn't sealed against
+ * shrinking could be truncated by the compositor while being read, raising
+ * SIGBUS, so it isn't mapped: it is read into a copy instead on every frame
+ * by read_memfd_planes().
+ */
+static void
+map_memfd (obs_pw_buffer_data *buffer_data,
+           struct spa_data    *data,
+           uint32_t            plane)
+{
+  long page_size = sysconf (_SC_PAGESIZE);
+  size_t page_offset;
+  struct stat st;
+  int seals;
+  void *ptr;
+
+  seals = fcntl (data->fd, F_GET_SEALS);
+  if (seals < 0 || !(seals & F_SEAL_SHRINK))
+    {
+      blog (LOG_DEBUG, "[pipewire] MemFd plane %u isn't sealed against shrinking, copying it", plane);
+
+      buffer_data->maps[plane].ptr = g_malloc (data->maxsize);
+      buffer_data->maps[plane].size = data->maxsize;
+      buffer_data->maps[plane].copy = true;
+      data->data = buffer_data->maps[plane].ptr;
+      return;
+    }
+
+  if (fstat (data->fd, &st) < 0 || (uint64_t) st.st_size < (uint64_t) data->mapoffset + data->maxsize)
+    {
+      blog (LOG_WARNING, "[pipewire] MemFd plane %u is smaller than advertised", plane);
+      return;
+    }
+
+  /* mmap() only takes offsets aligned to pages */
+  page_offset = data->mapoffset % page_size;
+
+  ptr = mmap (NULL, page_offset + data->maxsize, PROT_READ, MAP_SHARED, data->fd,
+              data->mapoffset - page_offset);
+  if (ptr == MAP_FAILED)
+    {
+      blog (LOG_WARNING, "[pipewire] Failed to map MemFd plane %u: %s", plane, strerror (errno));
+      return;
+    }
+
+  buffer_data->maps[plane].ptr = ptr;
+  buffer_data->maps[plane].size = page_offset + data->maxsize;
+  data->data = SPA_MEMBER (ptr, page_offset, void);
+}
+
+/*
+ * Reads the chunks of the MemFd planes that couldn't be mapped into their
+ * copies. Reading can't fault like a mapping does, a truncated memfd only
+ * makes the read short, in which case false is returned and the frame must
+ * be dropped.
+ */
+static bool
+read_memfd_planes (struct pw_buffer *b)
+{
+  obs_pw_buffer_data *buffer_data = b->user_data;
+  struct spa_buffer *buffer = b->buffer;
+
+  for (uint32_t i = 0; i < MIN (buffer->n_datas, MAX_MEMORY_PLANES); i++)
+    {
+      struct spa_data *data = &buffer->datas[i];
+      uint32_t offset;
+      uint32_t size;
+      ssize_t n_read;
+
+      if (!buffer_data->maps[i].copy)
+        continue;
+
+      offset = MIN (data->chunk->offset, data->maxsize);
+      size = MIN (data->chunk->size, data->maxsize - offset);
+
+      n_read = pread (data->fd, SPA_MEMBER (buffer_data->maps[i].ptr, offset, void),
+                      size, data->mapoffset + offset);
+      if (n_read < 0 || (size_t) n_read != size)
+        return false;
+    }
+
+  return true;
+}
+
+static void
+on_process_cb (void *user_data)
+{
+  obs_pw_capture *capture = user_data;
+  obs_pw_buffer_data *buffer_data;
+  struct pw_buffer *stale;
+  struct pw_buffer *b;
+  uint32_t n_slots;
+
+  drain_returned_buffers (capture);
+
+  /* Find the most recent buffer */
+  b = NULL;
+  while (true)
+    {
+      struct pw_buffer *aux = pw_stream_dequeue_buffer (capture->stream);
+      if (!aux)
+        break;
+      if (b)
+        {
+          pw_stream_queue_buffer (capture->stream, b);
+          g_atomic_int_set (&capture->damage_lost, TRUE);
+          g_atomic_int_inc (&capture->stats.dropped);
+        }
+      b = aux;
+      g_atomic_int_inc (&capture->stats.received);
+    }
+
+  if (!b)
+    {
+      blog (LOG_DEBUG, "[pipewire] Out of buffers!");
+      return;
+    }
+
+  /* Cursor-only updates carry metadata but no frame */
+  if (b->buffer->datas[0].chunk->size == 0)
+    g_atomic_int_inc (&capture->stats.empty);
+  else if (!read_memfd_planes (b))
+    {
+      blog (LOG_DEBUG, "[pipewire] MemFd plane was truncated, dropping frame");
+      pw_stream_queue_buffer (capture->stream, b);
+      g_atomic_int_set (&capture->damage_lost, TRUE);
+      g_atomic_int_inc (&capture->stats.dropped);
+      return;
+    }
+
+  if (capture->async)
+    {
+      output_async_frame (capture, b);
+      pw_stream_queue_buffer (capture->stream, b);
+      return;
+    }
+
+  /*
+   * Publish the frame for the render thread, which does all the graphics
+   * work. Only as many slots as the pool allows are used. If the frame
+   * previously published in the same slot wasn't picked up in time, it is
+   * stale and goes back to the compositor immediately. So do frames left
+   * in the slots beyond that, published before the pool shrank.
+   */
+  buffer_data = b->user_data;
+  buffer_data->sequence = capture->pending_sequence++;
+  buffer_data->dequeued = os_gettime_ns ();
+  buffer_data->pts = get_presentation_time (b->buffer, buffer_data->dequeued);
+
+  n_slots = MAX (get_hold_depth (capture), 1);
+
+  for (uint32_t i = 0; i < FRAME_QUEUE_SIZE; i++)
+    {
+      if (i == buffer_data->sequence % n_slots)
+        stale = exchange_pending_buffer (capture, i, b);
+      else if (i >= n_slots)
+        stale = exchange_pending_buffer (capture, i, NULL);
+      else
+        continue;
+
+      if (stale)
+        {
+          pw_stream_queue_buffer (capture->stream, stale);
+          g_atomic_int_set (&capture->damage_lost, TRUE);
+          g_atomic_int_inc (&capture->stats.dropped);
+        }
+    }
+}
+
+/*
+ * Computes the size the source wants to capture at. Returns false if the
+ * source wants the native size, or if it isn't known yet.
+ */
+static bool
+get_requested_size (obs_pipewire_data *xdg,
+                    uint32_t           native_width,
+                    uint32_t           native_height,
+                    uint32_t          *out_width,
+                    uint32_t          *out_height)
+{
+  switch (xdg->resolution.mode)
+    {
+    case CAPTURE_RESOLUTION_SCALED:
+      if (native_width == 0 || native_height == 0)
+        return false;
+      *out_width = MAX (native_width * xdg->resolution.scale / 100, 1);
+      *out_height = MAX (native_height * xdg->resolution.scale / 100, 1);
+      return true;
+
+    case CAPTURE_RESOLUTION_CUSTOM:
+      *out_width = xdg->resolution.width;
+      *out_height = xdg->resolution.height;
+      return true;
+
+    case CAPTURE_RESOLUTION_NATIVE:
+    default:
+      return false;
+    }
+}
+
+/*
+ * Picks the size, framerate and buffer pool to ask from the compositor, so
+ * that no source of the capture gets fewer pixels or frames than it asked
+ * for, and renegotiates the stream if they changed.
+ */
+static void
+update_requested_format (obs_pw_capture *capture)
+{
+  obs_pw_latency_mode latency_mode = LATENCY_MODE_LOW;
+  uint32_t max_framerate = 0;
+  uint32_t width = 0;
+  uint32_t height = 0;
+
+  pw_thread_loop_lock (capture->session->thread_loop);
+
+  for (guint i = 0; i < capture->sources->len; i++)
+    {
+      obs_pipewire_data *xdg = g_ptr_array_index (capture->sources, i);
+
+      max_framerate = MAX (max_framerate, xdg->max_framerate);
+      latency_mode = MAX (latency_mode, xdg->latency_mode);
+    }
+
+  for (guint i = 0; i < capture->sources->len; i++)
+    {
+      obs_pipewire_data *xdg = g_ptr_array_index (capture->sources, i);
+      uint32_t source_width, source_height;
+
+      if (!get_requested_size (xdg, capture->native_width, capture->native_height,
+                               &source_width, &source_height))
+        {
+          width = height = 0;
+          break;
+        }
+
+      if ((uint64_t) source_width * source_height > (uint64_t) width * height)
+        {
+          width = source_width;
+          height = source_height;
+        }
+    }
+
+  if (width != capture->requested_width ||
+      height != capture->requested_height ||
+      max_framerate != capture->max_framerate ||
+      latency_mode != capture->latency_mode)
+    {
+      capture->requested_width = width;
+      capture->requested_height = height;
+      capture->max_framerate = max_framerate;
+      capture->latency_mode = latency_mode;
 
-  blog (LOG_DEBUG, "[pipewire]     Size: %dx%d",
-        xdg->format.info.raw.size.width,
-        xdg->format.info.raw.size.height);
+      if (capture->reneg)
+        pw_loop_signal_event (pw_thread_loop_get_loop (capture->thread_loop), capture->reneg);
+    }
 
-  blog (LOG_DEBUG, "[pipewire]     Framerate: %d/%d",
-        xdg->format.info.raw.framerate.num,
-        xdg->format.info.raw.framerate.denom);
+  pw_thread_loop_unlock (capture->session->thread_loop);
+}
 
+/*
+ * Builds the Meta and Buffers params for the negotiated format, with the
+ * buffer types it can be shared with and the pool size of the latency mode.
+ * Returns the number of params.
+ */
+static uint32_t
+build_buffer_params (obs_pw_capture         *capture,
+                     struct spa_pod_builder *b,
+                     const struct spa_pod  **params)
+{
   /* Video crop */
-  pod_builder = SPA_POD_BUILDER_INIT (params_buffer, sizeof (params_buffer));
   params[0] = spa_pod_builder_add_object (
-    &pod_builder,
+    b,
 		SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
 		SPA_PARAM_META_type, SPA_POD_Id (SPA_META_VideoCrop),
 		SPA_PARAM_META_size, SPA_POD_Int (sizeof (struct spa_meta_region)));
 
   /* Cursor */
   params[1] = spa_pod_builder_add_object (
-    &pod_builder,
+    b,
     SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
     SPA_PARAM_META_type, SPA_POD_Id (SPA_META_Cursor),
     SPA_PARAM_META_size, SPA_POD_CHOICE_RANGE_Int (CURSOR_META_SIZE (64, 64),
                                                    CURSOR_META_SIZE (1, 1),
                                                    CURSOR_META_SIZE (1024, 1024)));
 
-  /* Buffer options */
+  /* Damage */
   params[2] = spa_pod_builder_add_object (
-    &pod_builder,
+    b,
+    SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
+    SPA_PARAM_META_type, SPA_POD_Id (SPA_META_VideoDamage),
+    SPA_PARAM_META_size, SPA_POD_CHOICE_RANGE_Int (DAMAGE_META_SIZE (16),
+                                                   DAMAGE_META_SIZE (1),
+                                                   DAMAGE_META_SIZE (16)));
+
+  /* Header, for presentation timestamps */
+  params[3] = spa_pod_builder_add_object (
+    b,
+    SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
+    SPA_PARAM_META_type, SPA_POD_Id (SPA_META_Header),
+    SPA_PARAM_META_size, SPA_POD_Int (sizeof (struct spa_meta_header)));
+
+  /* Buffer options, the pool size follows the latency mode */
+  params[4] = spa_pod_builder_add_object (
+    b,
     SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers,
-    SPA_PARAM_BUFFERS_dataType, SPA_POD_Int ((1 << SPA_DATA_MemPtr) |
-                                             (1 << SPA_DATA_DmaBuf)));
+    SPA_PARAM_BUFFERS_buffers, SPA_POD_CHOICE_RANGE_Int (latency_mode_pools[capture->latency_mode].buffers,
+                                                         latency_mode_pools[capture->latency_mode].min_buffers,
+                                                         latency_mode_pools[capture->latency_mode].max_buffers),
+    SPA_PARAM_BUFFERS_dataType, SPA_POD_Int (capture->buffer_types));
+
+
+  return N_BUFFER_PARAMS;
+}
+
+static void
+on_param_changed_cb (void                 *user_data,
+                     uint32_t              id,
+                     const struct spa_pod *param)
+{
+  obs_pw_capture *capture = user_data;
+  struct spa_pod_builder pod_builder;
+  const struct spa_pod *params[N_BUFFER_PARAMS];
+  const struct spa_pod_prop *modifier_prop;
+  struct spa_video_info format = { 0 };
+  uint8_t params_buffer[1024];
+  uint32_t buffer_types;
+  uint32_t n_params;
+  int result;
+
+  if (!param || id != SPA_PARAM_Format)
+    return;
+
+  result = spa_format_parse (param,
+                             &format.media_type,
+                             &format.media_subtype);
+  if (result < 0)
+    return;
+
+  if (format.media_type != SPA_MEDIA_TYPE_video ||
+      format.media_subtype != SPA_MEDIA_SUBTYPE_raw)
+    return;
+
+  spa_format_video_raw_parse (param, &format.info.raw);
+
+  /*
+   * Formats with a modifier were negotiated for DMA-BUFs. If the compositor
+   * left the modifier unfixated, the preferred (first) value of the choice
+   * was picked by the parser. Without a modifier, DMA-BUFs may still be
+   * used with an implicit modifier.
+   */
+  modifier_prop = spa_pod_find_prop (param, NULL, SPA_FORMAT_VIDEO_modifier);
+  if (modifier_prop)
+    {
+      if (modifier_prop->flags & SPA_POD_PROP_FLAG_DONT_FIXATE)
+        blog (LOG_DEBUG, "[pipewire] Modifier not fixated by the compositor, using the preferred one");
+
+      buffer_types = 1 << SPA_DATA_DmaBuf;
+    }
+  else if (capture->async || is_yuv_format (format.info.raw.format))
+    {
+      format.info.raw.modifier = DRM_FORMAT_MOD_INVALID;
+      buffer_types = (1 << SPA_DATA_MemPtr) | (1 << SPA_DATA_MemFd);
+    }
+  else
+    {
+      format.info.raw.modifier = DRM_FORMAT_MOD_INVALID;
+      buffer_types = (1 << SPA_DATA_MemPtr) | (1 << SPA_DATA_MemFd) | (1 << SPA_DATA_DmaBuf);
+    }
+
+  /*
+   * The render thread picks the new format up with its next frame. Frames
+   * it didn't collect yet are of the old format, so give them back.
+   */
+  g_mutex_lock (&capture->frame_lock);
+  capture->stream_format = format;
+  capture->format_changed = true;
+  capture->buffer_types = filter_buffer_types (capture, format.info.raw.format, buffer_types);
+  clear_frame_queue (capture);
+  g_mutex_unlock (&capture->frame_lock);
+
+  drain_returned_buffers (capture);
+
+  /*
+   * The native size is learned from the first negotiated format, whatever
+   * size was asked for: compositors that can't scale offer their native
+   * size regardless. A format of exactly the size we guessed may just be
+   * the compositor scaling, so it says nothing. A format of the portal's
+   * size is what the portal reports for the stream, so it is taken.
+   */
+  if (capture->native_width == 0 &&
+      (format.info.raw.size.width != capture->guessed_size.width ||
+       format.info.raw.size.height != capture->guessed_size.height))
+    {
+      capture->native_width = format.info.raw.size.width;
+      capture->native_height = format.info.raw.size.height;
+      update_requested_format (capture);
+    }
+
+  blog (LOG_DEBUG, "[pipewire] Negotiated format:");
+
+  blog (LOG_DEBUG, "[pipewire]     Format: %d (%s)",
+        capture->stream_format.info.raw.format,
+        spa_debug_type_find_name(spa_type_video_format,
+                                 capture->stream_format.info.raw.format));
+
+  blog (LOG_DEBUG, "[pipewire]     Modifier: 0x%" PRIx64,
+        capture->stream_format.info.raw.modifier);
+
+  blog (LOG_DEBUG, "[pipewire]     Size: %dx%d",
+        capture->stream_format.info.raw.size.width,
+        capture->stream_format.info.raw.size.height);
+
+  blog (LOG_DEBUG, "[pipewire]     Framerate: %d/%d",
+        capture->stream_format.info.raw.framerate.num,
+        capture->stream_format.info.raw.framerate.denom);
+
+  pod_builder = SPA_POD_BUILDER_INIT (params_buffer, sizeof (params_buffer));
+  n_params = build_buffer_params (capture, &pod_builder, params);
+  pw_stream_update_params (capture->stream, params, n_params);
 
-  pw_stream_update_params (xdg->stream, params, 3);
+  capture->negotiated = true;
+}
+
+static void
+on_add_buffer_cb (void             *user_data,
+                  struct pw_buffer *b)
+{
+  obs_pw_capture *capture = user_data;
+  obs_pw_buffer_data *buffer_data;
+  struct spa_buffer *buffer = b->buffer;
+
+  buffer_data = g_new0 (obs_pw_buffer_data, 1);
+  g_atomic_int_inc (&capture->n_buffers);
+
+  for (uint32_t i = 0; i < MIN (buffer->n_datas, MAX_MEMORY_PLANES); i++)
+    {
+      if (buffer->datas[i].type == SPA_DATA_MemFd)
+        map_memfd (buffer_data, &buffer->datas[i], i);
+    }
+
+  b->user_data = buffer_data;
+}
+
+static void
+on_remove_buffer_cb (void             *user_data,
+                     struct pw_buffer *b)
+{
+  obs_pw_capture *capture = user_data;
+  obs_pw_buffer_data *buffer_data = b->user_data;
+
+  if (!buffer_data)
+    return;
+
+  g_mutex_lock (&capture->frame_lock);
+
+  /* The render thread only returns buffers with frame_lock held */
+  drain_returned_buffers (capture);
+
+  for (uint32_t i = 0; i < FRAME_QUEUE_SIZE; i++)
+    g_atomic_pointer_compare_and_exchange (&capture->pending_pw_buffers[i], b, NULL);
+
+  for (uint32_t i = 0; i < capture->n_queued_pw_buffers; i++)
+    {
+      if (capture->queued_pw_buffers[i] != b)
+        continue;
+
+      memmove (&capture->queued_pw_buffers[i], &capture->queued_pw_buffers[i + 1],
+               (capture->n_queued_pw_buffers - i - 1) * sizeof (struct pw_buffer *));
+      capture->n_queued_pw_buffers--;
+      break;
+    }
+
+  if (capture->current_pw_buffer == b)
+    capture->current_pw_buffer = NULL;
+
+  /* Textures can only be destroyed with the sink lock, by the render thread */
+  if (buffer_data->texture)
+    g_ptr_array_add (capture->removed_textures, g_steal_pointer (&buffer_data->texture));
+
+  g_mutex_unlock (&capture->frame_lock);
+
+  g_atomic_int_add (&capture->n_buffers, -1);
+
+  for (uint32_t i = 0; i < MAX_MEMORY_PLANES; i++)
+    {
+      if (!buffer_data->maps[i].ptr)
+        continue;
+
+      if (buffer_data->maps[i].copy)
+        g_free (buffer_data->maps[i].ptr);
+      else
+        munmap (buffer_data->maps[i].ptr, buffer_data->maps[i].size);
+      b->buffer->datas[i].data = NULL;
+    }
 
-  xdg->negotiated = true;
+  b->user_data = NULL;
+  g_free (buffer_data);
 }
 
 static void
@@ -531,9 +2980,49 @@ static const struct pw_stream_events stream_events =
   PW_VERSION_STREAM_EVENTS,
   .state_changed = on_state_changed_cb,
   .param_changed = on_param_changed_cb,
+  .add_buffer = on_add_buffer_cb,
+  .remove_buffer = on_remove_buffer_cb,
   .process = on_process_cb,
 };
 
+static void
+requeue_buffers_cb (void     *user_data,
+                    uint64_t  expirations)
+{
+  drain_returned_buffers (user_data);
+}
+
+static void
+renegotiate_format_cb (void     *user_data,
+                       uint64_t  expirations)
+{
+  obs_pw_capture *capture = user_data;
+  const struct spa_pod *params[2 * N_SUPPORTED_FORMATS + N_BUFFER_PARAMS];
+  uint8_t params_buffer[FORMAT_PARAMS_BUFFER_SIZE];
+  struct spa_pod_builder pod_builder;
+  uint32_t n_params;
+
+  blog (LOG_INFO, "[pipewire] Renegotiating stream");
+
+  /* The render thread drops modifiers from the format info */
+  g_mutex_lock (&capture->frame_lock);
+  pod_builder = SPA_POD_BUILDER_INIT (params_buffer, sizeof (params_buffer));
+  n_params = build_format_params (capture, &pod_builder, params);
+  capture->buffer_types = filter_buffer_types (capture, capture->stream_format.info.raw.format,
+                                               capture->buffer_types);
+  g_mutex_unlock (&capture->frame_lock);
+
+  /*
+   * The compositor may keep the same format, in which case the Format param
+   * doesn't change and the Buffers param isn't sent again from there. Send
+   * it along, so pool size changes are applied either way.
+   */
+  if (capture->negotiated)
+    n_params += build_buffer_params (capture, &pod_builder, &params[n_params]);
+
+  pw_stream_update_params (capture->stream, params, n_params);
+}
+
 static void
 on_core_error_cb (void       *user_data,
                   uint32_t    id,
@@ -541,12 +3030,12 @@ on_core_error_cb (void       *user_data,
                   int         res,
                   const char *message)
 {
-  obs_pipewire_data *xdg = user_data;
+  obs_pw_session *session = user_data;
 
   blog (LOG_ERROR, "[pipewire] Error id:%u seq:%d res:%d (%s): %s",
         id, seq, res, g_strerror (res), message);
 
-  pw_thread_loop_signal (xdg->thread_loop, FALSE);
+  pw_thread_loop_signal (session->thread_loop, FALSE);
 }
 
 static void
@@ -554,10 +3043,10 @@ on_core_done_cb (void     *user_data,
                  uint32_t  id,
                  int       seq)
 {
-  obs_pipewire_data *xdg = user_data;
+  obs_pw_session *session = user_data;
 
   if (id == PW_ID_CORE)
-    pw_thread_loop_signal (xdg->thread_loop, FALSE);
+    pw_thread_loop_signal (session->thread_loop, FALSE);
 }
 
 static const struct pw_core_events core_events = {
@@ -567,79 +3056,291 @@ static const struct pw_core_events core_events = {
 };
 
 static void
-play_pipewire_stream (obs_pipewire_data *xdg)
+play_pipewire_stream (obs_pw_capture *capture)
 {
   struct spa_pod_builder pod_builder;
-  const struct spa_pod *params[1];
-  uint8_t params_buffer[1024];
-
-  xdg->thread_loop = pw_thread_loop_new ("PipeWire thread loop", NULL);
-  xdg->context = pw_context_new (pw_thread_loop_get_loop (xdg->thread_loop), NULL, 0);
+  const struct spa_pod *params[2 * N_SUPPORTED_FORMATS];
+  uint8_t params_buffer[FORMAT_PARAMS_BUFFER_SIZE];
+  uint32_t n_params;
 
-  if (pw_thread_loop_start (xdg->thread_loop) < 0)
-    {
-      blog (LOG_WARNING, "Error starting threaded mainloop");
-      return;
-    }
+  capture->thread_loop = capture->session->thread_loop;
 
-  pw_thread_loop_lock (xdg->thread_loop);
+  pw_thread_loop_lock (capture->thread_loop);
 
-  /* Core */
-  xdg->core = pw_context_connect_fd (xdg->context,
-                                     fcntl (xdg->pipewire_fd, F_DUPFD_CLOEXEC, 3),
-                                     NULL,
-                                     0);
-  if (!xdg->core)
-    {
-      blog (LOG_WARNING, "Error creating PipeWire core: %m");
-      pw_thread_loop_unlock (xdg->thread_loop);
-      return;
-    }
+  /* Dropped DMA-BUF modifiers are renegotiated from the PipeWire thread */
+  capture->reneg = pw_loop_add_event (pw_thread_loop_get_loop (capture->thread_loop),
+                                      renegotiate_format_cb,
+                                      capture);
 
-  pw_core_add_listener (xdg->core, &xdg->core_listener, &core_events, xdg);
+  /* Buffers given back by the render thread are queued from here too */
+  capture->requeue = pw_loop_add_event (pw_thread_loop_get_loop (capture->thread_loop),
+                                        requeue_buffers_cb,
+                                        capture);
 
   /* Stream */
-  xdg->stream = pw_stream_new (xdg->core,
-                               "OBS Studio",
-                               pw_properties_new (PW_KEY_MEDIA_TYPE, "Video",
-                                                  PW_KEY_MEDIA_CATEGORY, "Capture",
-                                                  PW_KEY_MEDIA_ROLE, "Screen",
-                                                  NULL));
-  pw_stream_add_listener (xdg->stream, &xdg->stream_listener, &stream_events, xdg);
+  capture->stream = pw_stream_new (capture->session->core,
+                                   "OBS Studio",
+                                   pw_properties_new (PW_KEY_MEDIA_TYPE, "Video",
+                                                      PW_KEY_MEDIA_CATEGORY, "Capture",
+                                                      PW_KEY_MEDIA_ROLE, "Screen",
+                                                      NULL));
+  pw_stream_add_listener (capture->stream, &capture->stream_listener, &stream_events, capture);
 
   /* Stream parameters */
+  init_format_info (capture);
+
   pod_builder = SPA_POD_BUILDER_INIT (params_buffer, sizeof (params_buffer));
-  params[0] = spa_pod_builder_add_object (
-    &pod_builder,
-    SPA_TYPE_OBJECT_Format, SPA_PARAM_EnumFormat,
-    SPA_FORMAT_mediaType, SPA_POD_Id (SPA_MEDIA_TYPE_video),
-    SPA_FORMAT_mediaSubtype, SPA_POD_Id (SPA_MEDIA_SUBTYPE_raw),
-    SPA_FORMAT_VIDEO_format, SPA_POD_CHOICE_ENUM_Id (4,
-                                                     SPA_VIDEO_FORMAT_RGBA,
-                                                     SPA_VIDEO_FORMAT_RGBx,
-                                                     SPA_VIDEO_FORMAT_BGRx,
-                                                     SPA_VIDEO_FORMAT_BGRA),
-    SPA_FORMAT_VIDEO_size, SPA_POD_CHOICE_RANGE_Rectangle (&SPA_RECTANGLE (320, 240),
-                                                           &SPA_RECTANGLE (1, 1),
-                                                           &SPA_RECTANGLE (4096, 4096)),
-    SPA_FORMAT_VIDEO_framerate, SPA_POD_CHOICE_RANGE_Fraction (&SPA_FRACTION (60, 1),
-                                                               &SPA_FRACTION (0, 1),
-                                                               &SPA_FRACTION (144, 1)));
-
-  pw_stream_connect (xdg->stream,
+  n_params = build_format_params (capture, &pod_builder, params);
+
+  pw_stream_connect (capture->stream,
                      PW_DIRECTION_INPUT,
-                     xdg->pipewire_node,
-                     PW_STREAM_FLAG_AUTOCONNECT | PW_STREAM_FLAG_MAP_BUFFERS,
+                     capture->node,
+                     PW_STREAM_FLAG_AUTOCONNECT,
                      params,
-                     1);
+                     n_params);
 
   blog (LOG_INFO, "[OBS XDG] Starting monitor screencast…");
 
-  pw_thread_loop_unlock (xdg->thread_loop);
+  pw_thread_loop_unlock (capture->thread_loop);
 }
 
 /* ------------------------------------------------- */
 
+/* Streams keep flowing for as long as any source showing them is shown */
+static void
+update_capture_active (obs_pw_capture *capture)
+{
+  bool active = false;
+
+  if (!capture->thread_loop)
+    return;
+
+  pw_thread_loop_lock (capture->thread_loop);
+
+  for (guint i = 0; i < capture->sources->len; i++)
+    {
+      obs_pipewire_data *xdg = g_ptr_array_index (capture->sources, i);
+      active |= xdg->shown;
+    }
+
+  if (capture->stream)
+    pw_stream_set_active (capture->stream, active);
+
+  pw_thread_loop_unlock (capture->thread_loop);
+}
+
+/* Uploads the smallest area covering the regions of all sources */
+static void
+update_capture_region (obs_pw_capture *capture)
+{
+  obs_pw_region region = { 0 };
+  uint32_t x1 = 0, y1 = 0;
+
+  pw_thread_loop_lock (capture->session->thread_loop);
+
+  for (guint i = 0; i < capture->sources->len; i++)
+    {
+      obs_pipewire_data *xdg = g_ptr_array_index (capture->sources, i);
+
+      if (!xdg->region.enabled)
+        {
+          region.enabled = false;
+          break;
+        }
+
+      if (!region.enabled)
+        {
+          region = xdg->region;
+          x1 = region.x + region.width;
+          y1 = region.y + region.height;
+          continue;
+        }
+
+      region.x = MIN (region.x, xdg->region.x);
+      region.y = MIN (region.y, xdg->region.y);
+      x1 = MAX (x1, xdg->region.x + xdg->region.width);
+      y1 = MAX (y1, xdg->region.y + xdg->region.height);
+    }
+
+  if (region.enabled)
+    {
+      region.width = x1 - region.x;
+      region.height = y1 - region.y;
+    }
+
+  frame_sink_lock ();
+  capture->region = region;
+  frame_sink_unlock ();
+
+  pw_thread_loop_unlock (capture->session->thread_loop);
+}
+
+static obs_pw_capture *
+capture_new (obs_pw_session *session,
+             uint32_t        node)
+{
+  obs_pw_capture *capture = g_new0 (obs_pw_capture, 1);
+
+  capture->session = session;
+  capture->node = node;
+  capture->async = session->async;
+  capture->sources = g_ptr_array_new ();
+  capture->removed_textures = g_ptr_array_new_with_free_func ((GDestroyNotify) frame_sink_texture_destroy);
+  g_mutex_init (&capture->frame_lock);
+
+  /* Monitors come with their size, only a hint until negotiated */
+  if (session->streams)
+    {
+      GVariant *stream_properties;
+      GVariantIter iter;
+      uint32_t stream_node;
+
+      g_variant_iter_init (&iter, session->streams);
+      while (g_variant_iter_loop (&iter, "(u@a{sv})", &stream_node, &stream_properties))
+        {
+          int width, height;
+
+          if (stream_node == node &&
+              g_variant_lookup (stream_properties, "size", "(ii)", &width, &height) &&
+              width > 0 && height > 0)
+            {
+              capture->portal_width = width;
+              capture->portal_height = height;
+            }
+        }
+    }
+
+  return capture;
+}
+
+static void
+capture_free (obs_pw_capture *capture)
+{
+  teardown_pipewire (capture);
+  destroy_textures (capture);
+
+  if (trace_file)
+    fflush (trace_file);
+
+  g_clear_pointer (&capture->sources, g_ptr_array_unref);
+  g_clear_pointer (&capture->removed_textures, g_ptr_array_unref);
+  g_mutex_clear (&capture->frame_lock);
+  g_free (capture);
+}
+
+static obs_pw_capture *
+find_capture (obs_pw_session *session,
+              uint32_t        node)
+{
+  for (guint i = 0; i < session->captures->len; i++)
+    {
+      obs_pw_capture *capture = g_ptr_array_index (session->captures, i);
+
+      if (capture->node == node)
+        return capture;
+    }
+
+  return NULL;
+}
+
+/* Starts showing the node assigned to the source, once the session is connected */
+static void
+join_capture (obs_pipewire_data *xdg)
+{
+  obs_pw_session *session = xdg->session;
+  obs_pw_capture *capture;
+
+  if (xdg->capture || xdg->pipewire_node == SPA_ID_INVALID || !session->core)
+    return;
+
+  capture = find_capture (session, xdg->pipewire_node);
+  if (capture)
+    {
+      blog (LOG_INFO, "[OBS XDG] Source '%s' shares the stream of node %u",
+            obs_source_get_name (xdg->source), capture->node);
+
+      pw_thread_loop_lock (session->thread_loop);
+      g_ptr_array_add (capture->sources, xdg);
+      pw_thread_loop_unlock (session->thread_loop);
+
+      update_requested_format (capture);
+    }
+  else
+    {
+      capture = capture_new (session, xdg->pipewire_node);
+      g_ptr_array_add (session->captures, capture);
+      g_ptr_array_add (capture->sources, xdg);
+
+      update_requested_format (capture);
+      play_pipewire_stream (capture);
+    }
+
+  update_capture_region (capture);
+
+  frame_sink_lock ();
+  xdg->capture = capture;
+  frame_sink_unlock ();
+
+  update_capture_active (capture);
+}
+
+static void
+leave_capture (obs_pipewire_data *xdg)
+{
+  obs_pw_capture *capture = xdg->capture;
+  obs_pw_session *session = xdg->session;
+
+  if (!capture)
+    return;
+
+  /* The render thread holds the sink lock while using the capture */
+  frame_sink_lock ();
+  xdg->capture = NULL;
+  frame_sink_unlock ();
+
+  pw_thread_loop_lock (session->thread_loop);
+  g_ptr_array_remove (capture->sources, xdg);
+  pw_thread_loop_unlock (session->thread_loop);
+
+  if (capture->sources->len > 0)
+    {
+      update_capture_active (capture);
+      update_capture_region (capture);
+      update_requested_format (capture);
+      return;
+    }
+
+  g_ptr_array_remove (session->captures, capture);
+  capture_free (capture);
+}
+
+static void
+connect_session (obs_pw_session *session)
+{
+  if (!acquire_shared_pipewire (session))
+    return;
+
+  pw_thread_loop_lock (session->thread_loop);
+
+  session->core = pw_context_connect_fd (session->context,
+                                         fcntl (session->pipewire_fd, F_DUPFD_CLOEXEC, 3),
+                                         NULL,
+                                         0);
+  if (!session->core)
+    {
+      blog (LOG_WARNING, "Error creating PipeWire core: %m");
+      pw_thread_loop_unlock (session->thread_loop);
+      return;
+    }
+
+  pw_core_add_listener (session->core, &session->core_listener, &core_events, session);
+
+  pw_thread_loop_unlock (session->thread_loop);
+
+  for (guint i = 0; i < session->members->len; i++)
+    join_capture (g_ptr_array_index (session->members, i));
+}
+
 static void
 on_pipewire_remote_opened_cb (GObject      *source,
                               GAsyncResult *res,
@@ -648,7 +3349,7 @@ on_pipewire_remote_opened_cb (GObject      *source,
   g_autoptr (GUnixFDList) fd_list = NULL;
   g_autoptr (GVariant) result = NULL;
   g_autoptr (GError) error = NULL;
-  obs_pipewire_data *xdg = user_data;
+  obs_pw_session *session = user_data;
   int fd_index;
 
   result = g_dbus_proxy_call_with_unix_fd_list_finish (G_DBUS_PROXY (source),
@@ -664,7 +3365,7 @@ on_pipewire_remote_opened_cb (GObject      *source,
 
   g_variant_get (result, "(h)", &fd_index, &error);
 
-  xdg->pipewire_fd = g_unix_fd_list_get (fd_list, fd_index, &error);
+  session->pipewire_fd = g_unix_fd_list_get (fd_list, fd_index, &error);
   if (error)
     {
       if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
@@ -672,28 +3373,108 @@ on_pipewire_remote_opened_cb (GObject      *source,
       return;
     }
 
-  play_pipewire_stream (xdg);
+  connect_session (session);
 }
 
 static void
-open_pipewire_remote (obs_pipewire_data *xdg)
+open_pipewire_remote (obs_pw_session *session)
 {
   GVariantBuilder builder;
 
   g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
 
-  g_dbus_proxy_call_with_unix_fd_list (xdg->proxy,
+  g_dbus_proxy_call_with_unix_fd_list (session->proxy,
                                        "OpenPipeWireRemote",
-                                       g_variant_new ("(oa{sv})", xdg->session_handle, &builder),
+                                       g_variant_new ("(oa{sv})", session->session_handle, &builder),
                                        G_DBUS_CALL_FLAGS_NONE,
                                        -1,
                                        NULL,
-                                       xdg->cancellable,
+                                       session->cancellable,
                                        on_pipewire_remote_opened_cb,
-                                       xdg);
+                                       session);
+}
+
+/* ------------------------------------------------- */
+
+static bool
+is_node_assigned (obs_pw_session *session,
+                  uint32_t        node)
+{
+  for (guint i = 0; i < session->members->len; i++)
+    {
+      obs_pipewire_data *xdg = g_ptr_array_index (session->members, i);
+
+      if (xdg->pipewire_node == node)
+        return true;
+    }
+
+  return false;
 }
 
-/* ------------------------------------------------- */
+/*
+ * Hands the selected streams out to the sources of the session that don't
+ * have one yet. Restored streams go to every source that stored their id,
+ * so duplicated sources share a stream, and the remaining streams go to the
+ * first source that can capture their type.
+ */
+static void
+assign_streams (obs_pw_session *session)
+{
+  for (int pass = 0; pass < 2; pass++)
+    {
+      GVariant *stream_properties;
+      GVariantIter iter;
+      uint32_t node;
+
+      g_variant_iter_init (&iter, session->streams);
+      while (g_variant_iter_loop (&iter, "(u@a{sv})", &node, &stream_properties))
+        {
+          const char *stream_id = NULL;
+          uint32_t source_type = 0;
+
+          g_variant_lookup (stream_properties, "id", "&s", &stream_id);
+          g_variant_lookup (stream_properties, "source_type", "u", &source_type);
+
+          if (pass == 0 && !stream_id)
+            continue;
+
+          if (pass == 1 && is_node_assigned (session, node))
+            continue;
+
+          for (guint i = 0; i < session->members->len; i++)
+            {
+              obs_pipewire_data *xdg = g_ptr_array_index (session->members, i);
+
+              if (xdg->pipewire_node != SPA_ID_INVALID)
+                continue;
+
+              if (pass == 0 &&
+                  g_strcmp0 (stream_id, obs_data_get_string (xdg->settings, "StreamId")) != 0)
+                continue;
+
+              if (pass == 1 && source_type != 0 && !(xdg->capture_type & source_type))
+                continue;
+
+              xdg->pipewire_node = node;
+
+              if (stream_id)
+                obs_data_set_string (xdg->settings, "StreamId", stream_id);
+
+              if (pass == 1)
+                break;
+            }
+        }
+    }
+
+  for (guint i = 0; i < session->members->len; i++)
+    {
+      obs_pipewire_data *xdg = g_ptr_array_index (session->members, i);
+
+      if (xdg->pipewire_node == SPA_ID_INVALID)
+        blog (LOG_WARNING, "[OBS XDG] No stream selected for source '%s'",
+              obs_source_get_name (xdg->source));
+    }
+}
 
 static void
 on_start_response_received_cb (GDBusConnection *connection,
@@ -704,12 +3485,10 @@ on_start_response_received_cb (GDBusConnection *connection,
                                GVariant        *parameters,
                                gpointer         user_data)
 {
-  g_autoptr (GVariant) stream_properties = NULL;
-  g_autoptr (GVariant) streams = NULL;
   g_autoptr (GVariant) result = NULL;
   dbus_call_data *call = user_data;
-  obs_pipewire_data *xdg = call->xdg;
-  GVariantIter iter;
+  obs_pw_session *session = call->session;
+  const char *restore_token;
   uint32_t response;
 
   g_clear_pointer (&call, dbus_call_data_free);
@@ -722,16 +3501,32 @@ on_start_response_received_cb (GDBusConnection *connection,
       return;
     }
 
-  streams = g_variant_lookup_value (result, "streams", G_VARIANT_TYPE_ARRAY);
+  /* Tokens are single use, so always store the new one */
+  if (g_variant_lookup (result, "restore_token", "&s", &restore_token))
+    {
+      g_free (session->restore_token);
+      session->restore_token = g_strdup (restore_token);
+
+      for (guint i = 0; i < session->members->len; i++)
+        {
+          obs_pipewire_data *xdg = g_ptr_array_index (session->members, i);
+          obs_data_set_string (xdg->settings, "RestoreToken", restore_token);
+        }
+    }
 
-  g_variant_iter_init (&iter, streams);
-  g_assert (g_variant_iter_n_children (&iter) == 1);
+  session->streams = g_variant_lookup_value (result, "streams", G_VARIANT_TYPE_ARRAY);
+  if (!session->streams)
+    {
+      blog (LOG_WARNING, "[OBS XDG] Screencast started without streams");
+      return;
+    }
 
-  g_variant_iter_loop (&iter, "(u@a{sv})", &xdg->pipewire_node, &stream_properties);
+  blog (LOG_INFO, "[OBS XDG] %" G_GSIZE_FORMAT " streams selected for %u sources, setting up screencast",
+        g_variant_n_children (session->streams), session->members->len);
 
-  blog (LOG_INFO, "[OBS XDG] Monitor selected, setting up screencast");
+  assign_streams (session);
 
-  open_pipewire_remote (xdg);
+  open_pipewire_remote (session);
 }
 
 static void
@@ -752,28 +3547,28 @@ on_started_cb (GObject      *source,
 }
 
 static void
-start (obs_pipewire_data *xdg)
+start (obs_pw_session *session)
 {
   g_autofree char *request_token = NULL;
   g_autofree char *request_path = NULL;
   GVariantBuilder builder;
   dbus_call_data *call;
 
-  new_request_path (xdg, &request_path, &request_token);
+  new_request_path (session, &request_path, &request_token);
 
   blog (LOG_INFO, "[OBS XDG] Asking for monitor…");
 
-  call = subscribe_to_signal (xdg, request_path, on_start_response_received_cb);
+  call = subscribe_to_signal (session, request_path, on_start_response_received_cb);
 
   g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
   g_variant_builder_add (&builder, "{sv}", "handle_token", g_variant_new_string (request_token));
 
-  g_dbus_proxy_call (xdg->proxy,
+  g_dbus_proxy_call (session->proxy,
                      "Start",
-                     g_variant_new ("(osa{sv})", xdg->session_handle, "", &builder),
+                     g_variant_new ("(osa{sv})", session->session_handle, "", &builder),
                      G_DBUS_CALL_FLAGS_NONE,
                      -1,
-                     xdg->cancellable,
+                     session->cancellable,
                      on_started_cb,
                      call);
 }
@@ -791,7 +3586,7 @@ on_select_source_response_received_cb (GDBusConnection *connection,
 {
   g_autoptr (GVariant) ret = NULL;
   dbus_call_data *call = user_data;
-  obs_pipewire_data *xdg = call->xdg;
+  obs_pw_session *session = call->session;
   uint32_t response;
 
   blog (LOG_DEBUG, "[OBS XDG] Response to select source received");
@@ -806,7 +3601,7 @@ on_select_source_response_received_cb (GDBusConnection *connection,
       return;
     }
 
-  start (xdg);
+  start (session);
 }
 
 static void
@@ -827,35 +3622,48 @@ on_source_selected_cb (GObject      *source,
 }
 
 static void
-select_source (obs_pipewire_data *xdg)
+select_source (obs_pw_session *session)
 {
   g_autofree char *request_token = NULL;
   g_autofree char *request_path = NULL;
   GVariantBuilder builder;
   dbus_call_data *call;
 
-  new_request_path (xdg, &request_path, &request_token);
+  new_request_path (session, &request_path, &request_token);
 
-  call = subscribe_to_signal (xdg, request_path, on_select_source_response_received_cb);
+  call = subscribe_to_signal (session, request_path, on_select_source_response_received_cb);
 
+  /* A single dialog picks the streams of every source in the session */
   g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
-  g_variant_builder_add (&builder, "{sv}", "types", g_variant_new_uint32 (xdg->capture_type));
-  g_variant_builder_add (&builder, "{sv}", "multiple", g_variant_new_boolean (FALSE));
+  g_variant_builder_add (&builder, "{sv}", "types", g_variant_new_uint32 (session->capture_types));
+  g_variant_builder_add (&builder, "{sv}", "multiple", g_variant_new_boolean (session->members->len > 1));
   g_variant_builder_add (&builder, "{sv}", "handle_token", g_variant_new_string (request_token));
 
-  if (xdg->available_cursor_modes & 4)
+  /* Async frames can't have the cursor drawn on top, so it must be embedded */
+  if (!session->async && (session->available_cursor_modes & 4))
     g_variant_builder_add (&builder, "{sv}", "cursor_mode", g_variant_new_uint32 (4));
-  else if ((xdg->available_cursor_modes & 2) && xdg->cursor.visible)
+  else if ((session->available_cursor_modes & 2) && session->cursor_visible)
     g_variant_builder_add (&builder, "{sv}", "cursor_mode", g_variant_new_uint32 (2));
   else
     g_variant_builder_add (&builder, "{sv}", "cursor_mode", g_variant_new_uint32 (1));
 
-  g_dbus_proxy_call (xdg->proxy,
+  /*
+   * Ask for the session to persist until it's explicitly revoked, and pass
+   * the token of the previous session so the portal can skip the dialog.
+   */
+  if (session->portal_version >= 4)
+    {
+      g_variant_builder_add (&builder, "{sv}", "persist_mode", g_variant_new_uint32 (2));
+      if (session->restore_token && *session->restore_token)
+        g_variant_builder_add (&builder, "{sv}", "restore_token", g_variant_new_string (session->restore_token));
+    }
+
+  g_dbus_proxy_call (session->proxy,
                      "SelectSources",
-                     g_variant_new ("(oa{sv})", xdg->session_handle, &builder),
+                     g_variant_new ("(oa{sv})", session->session_handle, &builder),
                      G_DBUS_CALL_FLAGS_NONE,
                      -1,
-                     xdg->cancellable,
+                     session->cancellable,
                      on_source_selected_cb,
                      call);
 }
@@ -873,7 +3681,7 @@ on_create_session_response_received_cb (GDBusConnection *connection,
 {
   g_autoptr (GVariant) result = NULL;
   dbus_call_data *call = user_data;
-  obs_pipewire_data *xdg = call->xdg;
+  obs_pw_session *session = call->session;
   uint32_t response;
 
   g_clear_pointer (&call, dbus_call_data_free);
@@ -888,9 +3696,9 @@ on_create_session_response_received_cb (GDBusConnection *connection,
 
   blog (LOG_INFO, "[OBS XDG] Screencast session created");
 
-  g_variant_lookup (result, "session_handle", "s", &xdg->session_handle);
+  g_variant_lookup (result, "session_handle", "s", &session->session_handle);
 
-  select_source (xdg);
+  select_source (session);
 }
 
 static void
@@ -911,7 +3719,7 @@ on_session_created_cb (GObject      *source,
 }
 
 static void
-create_session (obs_pipewire_data *xdg)
+create_session (obs_pw_session *session)
 {
   GVariantBuilder builder;
   g_autofree char *request_token = NULL;
@@ -919,21 +3727,21 @@ create_session (obs_pipewire_data *xdg)
   g_autofree char *session_token = NULL;
   dbus_call_data *call;
 
-  new_request_path (xdg, &request_path, &request_token);
-  new_session_path (xdg, NULL, &session_token);
+  new_request_path (session, &request_path, &request_token);
+  new_session_path (session, NULL, &session_token);
 
-  call = subscribe_to_signal (xdg, request_path, on_create_session_response_received_cb);
+  call = subscribe_to_signal (session, request_path, on_create_session_response_received_cb);
 
   g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
   g_variant_builder_add (&builder, "{sv}", "handle_token", g_variant_new_string (request_token));
   g_variant_builder_add (&builder, "{sv}", "session_handle_token", g_variant_new_string (session_token));
 
-  g_dbus_proxy_call (xdg->proxy,
+  g_dbus_proxy_call (session->proxy,
                      "CreateSession",
                      g_variant_new ("(a{sv})", &builder),
                      G_DBUS_CALL_FLAGS_NONE,
                      -1,
-                     xdg->cancellable,
+                     session->cancellable,
                      on_session_created_cb,
                      call);
 }
@@ -941,15 +3749,26 @@ create_session (obs_pipewire_data *xdg)
 /* ------------------------------------------------- */
 
 static void
-update_available_cursor_modes (obs_pipewire_data *xdg)
+update_portal_version (obs_pw_session *session)
+{
+  g_autoptr (GVariant) cached_version = NULL;
+
+  cached_version = g_dbus_proxy_get_cached_property (session->proxy, "version");
+  session->portal_version = cached_version ? g_variant_get_uint32 (cached_version) : 0;
+
+  blog (LOG_INFO, "[OBS XDG] ScreenCast portal version: %u", session->portal_version);
+}
+
+static void
+update_available_cursor_modes (obs_pw_session *session)
 {
   g_autoptr (GVariant) cached_cursor_modes = NULL;
   uint32_t available_cursor_modes;
 
-  cached_cursor_modes = g_dbus_proxy_get_cached_property (xdg->proxy, "AvailableCursorModes");
+  cached_cursor_modes = g_dbus_proxy_get_cached_property (session->proxy, "AvailableCursorModes");
   available_cursor_modes = cached_cursor_modes ? g_variant_get_uint32 (cached_cursor_modes) : 0;
 
-  xdg->available_cursor_modes = available_cursor_modes;
+  session->available_cursor_modes = available_cursor_modes;
 
   blog (LOG_INFO, "[OBS XDG] Available cursor modes:");
   if (available_cursor_modes & 4)
@@ -965,12 +3784,12 @@ on_proxy_created_cb (GObject      *source,
                      GAsyncResult *res,
                      gpointer      user_data)
 {
+  g_autoptr (GDBusProxy) proxy = NULL;
   g_autoptr (GError) error = NULL;
-  obs_pipewire_data *xdg;
-
-  xdg = user_data;
-  xdg->proxy = g_dbus_proxy_new_finish (res, &error);
+  obs_pw_session *session;
 
+  /* The session may be gone already if this was cancelled */
+  proxy = g_dbus_proxy_new_finish (res, &error);
   if (error)
     {
       if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
@@ -978,52 +3797,258 @@ on_proxy_created_cb (GObject      *source,
       return;
     }
 
-  update_available_cursor_modes (xdg);
-  create_session (xdg);
+  session = user_data;
+  session->proxy = g_steal_pointer (&proxy);
+
+  update_portal_version (session);
+  update_available_cursor_modes (session);
+  create_session (session);
 }
 
 static void
-create_proxy (obs_pipewire_data *xdg)
+create_proxy (obs_pw_session *session)
 {
-  g_dbus_proxy_new (xdg->connection,
+  g_dbus_proxy_new (session->connection,
                     G_DBUS_PROXY_FLAGS_NONE,
                     NULL,
                     "org.freedesktop.portal.Desktop",
                     "/org/freedesktop/portal/desktop",
                     "org.freedesktop.portal.ScreenCast",
-                    xdg->cancellable,
+                    session->cancellable,
                     on_proxy_created_cb,
-                    xdg);
+                    session);
 }
 
 /* ------------------------------------------------- */
 
-static gboolean
-init_obs_xdg (obs_pipewire_data *xdg)
+static void
+on_bus_acquired_cb (GObject      *source,
+                    GAsyncResult *res,
+                    gpointer      user_data)
 {
+  g_autoptr (GDBusConnection) connection = NULL;
   g_autoptr (GError) error = NULL;
+  obs_pw_session *session;
   char *aux;
 
-  xdg->pipewire_fd = -1;
-  xdg->cancellable = g_cancellable_new ();
-  xdg->connection = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, &error);
+  connection = g_bus_get_finish (res, &error);
   if (error)
     {
-      g_error ("Error getting session bus: %s", error->message);
-      return FALSE;
+      if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        blog (LOG_ERROR, "[OBS XDG] Error getting session bus: %s", error->message);
+      return;
     }
 
-  xdg->sender_name = g_strdup (g_dbus_connection_get_unique_name (xdg->connection) + 1);
+  session = user_data;
+  session->connection = g_steal_pointer (&connection);
+  session->sender_name = g_strdup (g_dbus_connection_get_unique_name (session->connection) + 1);
 
   /* Replace dots by underscores */
-  while ((aux = g_strstr_len (xdg->sender_name, -1, ".")) != NULL)
+  while ((aux = g_strstr_len (session->sender_name, -1, ".")) != NULL)
     *aux = '_';
 
-  blog (LOG_INFO, "OBS XDG initialized (sender name: %s)", xdg->sender_name);
+  blog (LOG_INFO, "OBS XDG initialized (sender name: %s)", session->sender_name);
+
+  create_proxy (session);
+}
+
+static obs_pw_session *
+session_new (obs_pipewire_data *xdg)
+{
+  obs_pw_session *session = g_new0 (obs_pw_session, 1);
+
+  session->members = g_ptr_array_new ();
+  session->captures = g_ptr_array_new ();
+  session->cancellable = g_cancellable_new ();
+  session->pipewire_fd = -1;
+  session->async = xdg->async;
+  session->cursor_visible = xdg->cursor_visible;
+  session->restore_token = g_strdup (obs_data_get_string (xdg->settings, "RestoreToken"));
+
+  active_sessions = g_list_prepend (active_sessions, session);
+
+  return session;
+}
+
+/* Sources must have left the session, so that no stream uses the core */
+static void
+session_free (obs_pw_session *session)
+{
+  active_sessions = g_list_remove (active_sessions, session);
+
+  if (session->core)
+    {
+      pw_thread_loop_lock (session->thread_loop);
+      spa_hook_remove (&session->core_listener);
+      pw_core_disconnect (session->core);
+      session->core = NULL;
+      pw_thread_loop_unlock (session->thread_loop);
+    }
+
+  release_shared_pipewire (session);
+
+  if (session->pipewire_fd >= 0)
+    close (session->pipewire_fd);
+
+  if (session->session_handle)
+    {
+      g_dbus_connection_call (session->connection,
+                              "org.freedesktop.portal.Desktop",
+                              session->session_handle,
+                              "org.freedesktop.portal.Session",
+                              "Close",
+                              NULL,
+                              NULL,
+                              G_DBUS_CALL_FLAGS_NONE,
+                              -1, NULL, NULL, NULL);
+    }
+
+  g_cancellable_cancel (session->cancellable);
+  g_clear_object (&session->cancellable);
+  g_clear_object (&session->connection);
+  g_clear_object (&session->proxy);
+  g_clear_pointer (&session->sender_name, g_free);
+  g_clear_pointer (&session->session_handle, g_free);
+  g_clear_pointer (&session->restore_token, g_free);
+  g_clear_pointer (&session->streams, g_variant_unref);
+  g_clear_pointer (&session->captures, g_ptr_array_unref);
+  g_clear_pointer (&session->members, g_ptr_array_unref);
+  g_free (session);
+}
+
+static bool
+session_accepts (obs_pw_session    *session,
+                 obs_pipewire_data *xdg)
+{
+  return session->async == xdg->async &&
+         session->cursor_visible == xdg->cursor_visible &&
+         g_strcmp0 (session->restore_token, obs_data_get_string (xdg->settings, "RestoreToken")) == 0;
+}
+
+/*
+ * Sources created in the same main loop iteration, like when a scene
+ * collection is loaded, share as few portal sessions as possible: sources
+ * with the same restore token and cursor mode go into the same session.
+ * Sources restoring the token of a running session, like duplicated ones,
+ * join it directly and share its streams.
+ */
+static gboolean
+start_pending_sessions_cb (gpointer user_data)
+{
+  g_autoptr (GPtrArray) sessions = g_ptr_array_new ();
+  g_autoptr (GPtrArray) joined = g_ptr_array_new ();
+
+  G_LOCK (pending_sources);
+
+  for (guint i = 0; pending_sources && i < pending_sources->len; i++)
+    {
+      obs_pipewire_data *xdg = g_ptr_array_index (pending_sources, i);
+      obs_pw_session *session = NULL;
+
+      for (GList *l = active_sessions; l && !session; l = l->next)
+        {
+          obs_pw_session *active = l->data;
+
+          if (active->restore_token && *active->restore_token &&
+              !g_ptr_array_find (sessions, active, NULL) &&
+              session_accepts (active, xdg))
+            {
+              session = active;
+              g_ptr_array_add (joined, xdg);
+            }
+        }
+
+      for (guint j = 0; j < sessions->len && !session; j++)
+        {
+          if (session_accepts (g_ptr_array_index (sessions, j), xdg))
+            session = g_ptr_array_index (sessions, j);
+        }
+
+      if (!session)
+        {
+          session = session_new (xdg);
+          g_ptr_array_add (sessions, session);
+        }
+
+      session->capture_types |= xdg->capture_type;
+      g_ptr_array_add (session->members, xdg);
+      xdg->session = session;
+    }
+
+  g_clear_pointer (&pending_sources, g_ptr_array_unref);
+
+  G_UNLOCK (pending_sources);
+
+  for (guint i = 0; i < joined->len; i++)
+    {
+      obs_pipewire_data *xdg = g_ptr_array_index (joined, i);
+
+      blog (LOG_INFO, "[OBS XDG] Source '%s' joined a running screencast session",
+            obs_source_get_name (xdg->source));
+
+      /* Otherwise, the streams are assigned once the session starts */
+      if (xdg->session->streams)
+        {
+          assign_streams (xdg->session);
+          join_capture (xdg);
+        }
+    }
+
+  for (guint i = 0; i < sessions->len; i++)
+    {
+      obs_pw_session *session = g_ptr_array_index (sessions, i);
+
+      blog (LOG_INFO, "[OBS XDG] Starting screencast session for %u sources", session->members->len);
+
+      g_bus_get (G_BUS_TYPE_SESSION, session->cancellable, on_bus_acquired_cb, session);
+    }
+
+  return G_SOURCE_REMOVE;
+}
+
+/*
+ * Starts connecting the source to the portal. Every step is asynchronous,
+ * so this returns immediately, and the source draws nothing until its
+ * stream is negotiated.
+ */
+static void
+queue_source (obs_pipewire_data *xdg)
+{
+  G_LOCK (pending_sources);
+
+  if (!pending_sources)
+    {
+      pending_sources = g_ptr_array_new ();
+      g_idle_add (start_pending_sessions_cb, NULL);
+    }
+
+  g_ptr_array_add (pending_sources, xdg);
+
+  G_UNLOCK (pending_sources);
+}
+
+static void
+leave_session (obs_pipewire_data *xdg)
+{
+  obs_pw_session *session = xdg->session;
+
+  G_LOCK (pending_sources);
+  if (pending_sources)
+    g_ptr_array_remove (pending_sources, xdg);
+  G_UNLOCK (pending_sources);
+
+  leave_capture (xdg);
+
+  xdg->session = NULL;
+  xdg->pipewire_node = SPA_ID_INVALID;
+
+  if (!session)
+    return;
 
-  create_proxy (xdg);
+  g_ptr_array_remove (session->members, xdg);
 
-  return TRUE;
+  if (session->members->len == 0)
+    session_free (session);
 }
 
 static bool
@@ -1033,14 +4058,104 @@ reload_session_cb (obs_properties_t *properties,
 {
   obs_pipewire_data *xdg = data;
 
-  teardown_pipewire (xdg);
-  destroy_session (xdg);
+  leave_session (xdg);
+
+  /* Reloading is how users pick another source, so don't restore this one */
+  obs_data_set_string (xdg->settings, "RestoreToken", NULL);
+  obs_data_set_string (xdg->settings, "StreamId", NULL);
 
-  init_obs_xdg (xdg);
+  queue_source (xdg);
 
   return false;
 }
 
+static void
+load_capture_settings (obs_pipewire_data *xdg,
+                       obs_data_t        *settings)
+{
+  xdg->resolution.mode = obs_data_get_int (settings, "CaptureResolution");
+  xdg->resolution.scale = CLAMP (obs_data_get_int (settings, "CaptureScale"), 1, 100);
+  xdg->resolution.width = MAX (obs_data_get_int (settings, "CaptureWidth"), 1);
+  xdg->resolution.height = MAX (obs_data_get_int (settings, "CaptureHeight"), 1);
+  xdg->max_framerate = CLAMP (obs_data_get_int (settings, "MaxFramerate"), 1, MAX_FRAMERATE);
+  xdg->latency_mode = CLAMP (obs_data_get_int (settings, "LatencyMode"), LATENCY_MODE_LOW, LATENCY_MODE_SMOOTH);
+
+  xdg->region.enabled = obs_data_get_bool (settings, "CaptureRegion");
+  xdg->region.x = MAX (obs_data_get_int (settings, "RegionX"), 0);
+  xdg->region.y = MAX (obs_data_get_int (settings, "RegionY"), 0);
+  xdg->region.width = MAX (obs_data_get_int (settings, "RegionWidth"), 1);
+  xdg->region.height = MAX (obs_data_get_int (settings, "RegionHeight"), 1);
+}
+
+static bool
+capture_resolution_modified_cb (obs_properties_t *properties,
+                                obs_property_t   *property,
+                                obs_data_t       *settings)
+{
+  obs_pw_capture_resolution mode = obs_data_get_int (settings, "CaptureResolution");
+
+  obs_property_set_visible (obs_properties_get (properties, "CaptureScale"),
+                            mode == CAPTURE_RESOLUTION_SCALED);
+  obs_property_set_visible (obs_properties_get (properties, "CaptureWidth"),
+                            mode == CAPTURE_RESOLUTION_CUSTOM);
+  obs_property_set_visible (obs_properties_get (properties, "CaptureHeight"),
+                            mode == CAPTURE_RESOLUTION_CUSTOM);
+
+  return true;
+}
+
+static bool
+capture_region_modified_cb (obs_properties_t *properties,
+                            obs_property_t   *property,
+                            obs_data_t       *settings)
+{
+  bool enabled = obs_data_get_bool (settings, "CaptureRegion");
+
+  obs_property_set_visible (obs_properties_get (properties, "RegionX"), enabled);
+  obs_property_set_visible (obs_properties_get (properties, "RegionY"), enabled);
+  obs_property_set_visible (obs_properties_get (properties, "RegionWidth"), enabled);
+  obs_property_set_visible (obs_properties_get (properties, "RegionHeight"), enabled);
+
+  return true;
+}
+
+/*
+ * proc handler get_stats, returning the counters of the stream shown by the
+ * source, the latency histogram and the latency percentiles of each step
+ * as strings.
+ */
+static void
+get_stats_proc (void       *data,
+                calldata_t *cd)
+{
+  obs_pipewire_data *xdg = data;
+  g_autofree char *timings = NULL;
+  g_autofree char *latency = NULL;
+  obs_pw_capture *capture;
+
+  /* The capture is only swapped and freed with the sink lock held */
+  frame_sink_lock ();
+
+  capture = xdg->capture;
+
+  calldata_set_int (cd, "received", capture ? g_atomic_int_get (&capture->stats.received) : 0);
+  calldata_set_int (cd, "dropped", capture ? g_atomic_int_get (&capture->stats.dropped) : 0);
+  calldata_set_int (cd, "empty", capture ? g_atomic_int_get (&capture->stats.empty) : 0);
+  calldata_set_int (cd, "rendered", g_atomic_int_get (&xdg->stats.rendered));
+  calldata_set_int (cd, "repeated", g_atomic_int_get (&xdg->stats.repeated));
+
+  if (capture)
+    {
+      latency = format_latency_histogram (capture);
+      timings = format_frame_timings (capture);
+    }
+
+  frame_sink_unlock ();
+
+  calldata_set_string (cd, "latency", latency ? latency : "");
+  calldata_set_string (cd, "timings", timings ? timings : "");
+}
+
 /* obs_source_info methods */
 
 void*
@@ -1053,10 +4168,18 @@ obs_pipewire_create (obs_pw_capture_type  capture_type,
   xdg->source = source;
   xdg->settings = settings;
   xdg->capture_type = capture_type;
-  xdg->cursor.visible = obs_data_get_bool (settings, "ShowCursor");
+  xdg->async = (obs_source_get_output_flags (source) & OBS_SOURCE_ASYNC) != 0;
+  xdg->cursor_visible = obs_data_get_bool (settings, "ShowCursor");
+  xdg->pipewire_node = SPA_ID_INVALID;
+  xdg->shown = true;
+  load_capture_settings (xdg, settings);
 
-  if (!init_obs_xdg (xdg))
-    g_clear_pointer (&xdg, g_free);
+  proc_handler_add (obs_source_get_proc_handler (source),
+                    "void get_stats(out int received, out int dropped, out int empty, "
+                    "out int rendered, out int repeated, out string latency, out string timings)",
+                    get_stats_proc, xdg);
+
+  queue_source (xdg);
 
   return xdg;
 }
@@ -1067,8 +4190,7 @@ obs_pipewire_destroy (obs_pipewire_data *xdg)
   if (!xdg)
     return;
 
-  teardown_pipewire (xdg);
-  destroy_session (xdg);
+  leave_session (xdg);
 
   g_free (xdg);
 }
@@ -1076,7 +4198,25 @@ obs_pipewire_destroy (obs_pipewire_data *xdg)
 void
 obs_pipewire_get_defaults (obs_data_t *settings)
 {
+  struct obs_video_info ovi;
+  uint32_t canvas_framerate = 60;
+
+  /* Frames above the canvas framerate would only be dropped */
+  if (obs_get_video_info (&ovi) && ovi.fps_den > 0)
+    canvas_framerate = (ovi.fps_num + ovi.fps_den - 1) / ovi.fps_den;
+
   obs_data_set_default_bool (settings, "ShowCursor", true);
+  obs_data_set_default_int (settings, "MaxFramerate", canvas_framerate);
+  obs_data_set_default_int (settings, "LatencyMode", LATENCY_MODE_BALANCED);
+  obs_data_set_default_int (settings, "CaptureResolution", CAPTURE_RESOLUTION_NATIVE);
+  obs_data_set_default_int (settings, "CaptureScale", 50);
+  obs_data_set_default_int (settings, "CaptureWidth", 1920);
+  obs_data_set_default_int (settings, "CaptureHeight", 1080);
+  obs_data_set_default_bool (settings, "CaptureRegion", false);
+  obs_data_set_default_int (settings, "RegionX", 0);
+  obs_data_set_default_int (settings, "RegionY", 0);
+  obs_data_set_default_int (settings, "RegionWidth", 800);
+  obs_data_set_default_int (settings, "RegionHeight", 600);
 }
 
 obs_properties_t *
@@ -1084,6 +4224,7 @@ obs_pipewire_get_properties (obs_pipewire_data *xdg,
                              const char        *reload_string_id)
 {
   obs_properties_t *properties;
+  obs_property_t *property;
 
   properties = obs_properties_create ();
   obs_properties_add_button2 (properties, "Reload",
@@ -1092,6 +4233,46 @@ obs_pipewire_get_properties (obs_pipewire_data *xdg,
                               xdg);
   obs_properties_add_bool (properties, "ShowCursor", obs_module_text ("ShowCursor"));
 
+  property = obs_properties_add_list (properties, "CaptureResolution",
+                                      obs_module_text ("CaptureResolution"),
+                                      OBS_COMBO_TYPE_LIST,
+                                      OBS_COMBO_FORMAT_INT);
+  obs_property_list_add_int (property, obs_module_text ("CaptureResolution.Native"),
+                             CAPTURE_RESOLUTION_NATIVE);
+  obs_property_list_add_int (property, obs_module_text ("CaptureResolution.Scaled"),
+                             CAPTURE_RESOLUTION_SCALED);
+  obs_property_list_add_int (property, obs_module_text ("CaptureResolution.Custom"),
+                             CAPTURE_RESOLUTION_CUSTOM);
+  obs_property_set_modified_callback (property, capture_resolution_modified_cb);
+
+  property = obs_properties_add_int_slider (properties, "CaptureScale",
+                                            obs_module_text ("CaptureScale"),
+                                            10, 100, 5);
+  obs_property_int_set_suffix (property, "%");
+
+  obs_properties_add_int (properties, "CaptureWidth", obs_module_text ("CaptureWidth"), 1, 16384, 1);
+  obs_properties_add_int (properties, "CaptureHeight", obs_module_text ("CaptureHeight"), 1, 16384, 1);
+
+  property = obs_properties_add_bool (properties, "CaptureRegion", obs_module_text ("CaptureRegion"));
+  obs_property_set_modified_callback (property, capture_region_modified_cb);
+
+  obs_properties_add_int (properties, "RegionX", obs_module_text ("RegionX"), 0, 16383, 1);
+  obs_properties_add_int (properties, "RegionY", obs_module_text ("RegionY"), 0, 16383, 1);
+  obs_properties_add_int (properties, "RegionWidth", obs_module_text ("RegionWidth"), 1, 16384, 1);
+  obs_properties_add_int (properties, "RegionHeight", obs_module_text ("RegionHeight"), 1, 16384, 1);
+
+  property = obs_properties_add_int (properties, "MaxFramerate", obs_module_text ("MaxFramerate"),
+                                     1, MAX_FRAMERATE, 1);
+  obs_property_int_set_suffix (property, " FPS");
+
+  property = obs_properties_add_list (properties, "LatencyMode",
+                                      obs_module_text ("LatencyMode"),
+                                      OBS_COMBO_TYPE_LIST,
+                                      OBS_COMBO_FORMAT_INT);
+  obs_property_list_add_int (property, obs_module_text ("LatencyMode.Low"), LATENCY_MODE_LOW);
+  obs_property_list_add_int (property, obs_module_text ("LatencyMode.Balanced"), LATENCY_MODE_BALANCED);
+  obs_property_list_add_int (property, obs_module_text ("LatencyMode.Smooth"), LATENCY_MODE_SMOOTH);
+
   return properties;
 }
 
@@ -1099,90 +4280,367 @@ void
 obs_pipewire_update (obs_pipewire_data *xdg,
                      obs_data_t        *settings)
 {
-  xdg->cursor.visible = obs_data_get_bool (settings, "ShowCursor");
+  xdg->cursor_visible = obs_data_get_bool (settings, "ShowCursor");
+
+  load_capture_settings (xdg, settings);
+  if (xdg->capture)
+    {
+      update_capture_region (xdg->capture);
+      update_requested_format (xdg->capture);
+    }
 }
 
 void
 obs_pipewire_show (obs_pipewire_data *xdg)
 {
-  if (xdg->stream)
-    pw_stream_set_active (xdg->stream, true);
+  xdg->shown = true;
+
+  if (xdg->capture)
+    update_capture_active (xdg->capture);
 }
 
 void
 obs_pipewire_hide (obs_pipewire_data *xdg)
 {
-  if (xdg->stream)
-    pw_stream_set_active (xdg->stream, false);
+  xdg->shown = false;
+
+  if (xdg->capture)
+    update_capture_active (xdg->capture);
+}
+
+/* Part of the frame shown by the source, after cropping */
+static void
+get_source_rect (obs_pipewire_data *xdg,
+                 obs_pw_rect       *out)
+{
+  obs_pw_rect view;
+
+  get_view_rect (xdg->capture, &view);
+  apply_region (xdg->capture, &xdg->capture->format, &xdg->region, &view, out);
+}
+
+/*
+ * Size of the source. Compositors that can't scale send frames larger than
+ * the requested size, and those frames are scaled when drawing instead.
+ */
+static void
+get_output_size (obs_pipewire_data *xdg,
+                 uint32_t          *width,
+                 uint32_t          *height)
+{
+  obs_pw_capture *capture = xdg->capture;
+  uint32_t requested_width, requested_height;
+  obs_pw_rect rect;
+
+  get_source_rect (xdg, &rect);
+
+  *width = rect.width;
+  *height = rect.height;
+
+  if (capture->format.info.raw.size.width == 0 ||
+      capture->format.info.raw.size.height == 0 ||
+      !get_requested_size (xdg, capture->native_width, capture->native_height,
+                           &requested_width, &requested_height))
+    return;
+
+  *width = MAX ((uint64_t) requested_width * rect.width / capture->format.info.raw.size.width, 1);
+  *height = MAX ((uint64_t) requested_height * rect.height / capture->format.info.raw.size.height, 1);
 }
 
 uint32_t
 obs_pipewire_get_width (obs_pipewire_data *xdg)
 {
-  if (!xdg->negotiated)
+  uint32_t width, height;
+
+  if (!xdg->capture || !xdg->capture->negotiated)
     return 0;
 
-  if (xdg->crop.valid)
-    return xdg->crop.width;
-  else
-    return xdg->format.info.raw.size.width;
+  get_output_size (xdg, &width, &height);
+
+  return width;
 }
 
 uint32_t
 obs_pipewire_get_height (obs_pipewire_data *xdg)
 {
-  if (!xdg->negotiated)
+  uint32_t width, height;
+
+  if (!xdg->capture || !xdg->capture->negotiated)
     return 0;
 
-  if (xdg->crop.valid)
-    return xdg->crop.height;
+  get_output_size (xdg, &width, &height);
+
+  return height;
+}
+
+/*
+ * Draws a rectangle of the frame. Memory textures only hold the upload
+ * area, imported DMA-BUFs always hold the whole frame.
+ */
+static void
+draw_frame (obs_pw_capture    *capture,
+            const obs_pw_rect *rect)
+{
+  gs_texture_t *texture = frame_sink_texture_get_gs_texture (capture->texture);
+  uint32_t x = rect->x;
+  uint32_t y = rect->y;
+
+  if (capture->texture == capture->memory_textures[0])
+    {
+      x -= MIN (x, capture->upload.x);
+      y -= MIN (y, capture->upload.y);
+    }
+
+  if (x == 0 && y == 0 &&
+      rect->width == gs_texture_get_width (texture) &&
+      rect->height == gs_texture_get_height (texture))
+    {
+      gs_draw_sprite (texture, 0, 0, 0);
+    }
   else
-    return xdg->format.info.raw.size.height;
+    {
+      gs_draw_sprite_subregion (texture, 0, x, y, rect->width, rect->height);
+    }
+}
+
+/* Draws the tiles as a mosaic, cropping across tile boundaries */
+static void
+draw_tiles (obs_pw_capture    *capture,
+            gs_eparam_t       *image,
+            const obs_pw_rect *rect)
+{
+  int x0 = rect->x;
+  int y0 = rect->y;
+  int x1 = rect->x + rect->width;
+  int y1 = rect->y + rect->height;
+
+  for (guint i = 0; i < capture->tiles->len; i++)
+    {
+      gs_texture_t *tile = frame_sink_texture_get_gs_texture (g_ptr_array_index (capture->tiles, i));
+      int tile_x = capture->upload.x + (i % capture->n_tile_columns) * TILE_SIZE;
+      int tile_y = capture->upload.y + (i / capture->n_tile_columns) * TILE_SIZE;
+      int left = MAX (x0, tile_x);
+      int top = MAX (y0, tile_y);
+      int right = MIN (x1, tile_x + (int) gs_texture_get_width (tile));
+      int bottom = MIN (y1, tile_y + (int) gs_texture_get_height (tile));
+
+      if (left >= right || top >= bottom)
+        continue;
+
+      gs_effect_set_texture (image, tile);
+
+      gs_matrix_push ();
+      gs_matrix_translate3f ((float) (left - x0), (float) (top - y0), 0.0f);
+      gs_draw_sprite_subregion (tile, 0, left - tile_x, top - tile_y, right - left, bottom - top);
+      gs_matrix_pop ();
+    }
+}
+
+static void
+set_yuv_color_params (obs_pw_capture *capture)
+{
+  float color_matrix[16];
+  float color_range_min[3];
+  float color_range_max[3];
+
+  get_yuv_color_params (capture, color_matrix, color_range_min, color_range_max);
+
+  gs_effect_set_val (gs_effect_get_param_by_name (capture->yuv_effect, "color_matrix"),
+                     color_matrix, sizeof (color_matrix));
+  gs_effect_set_val (gs_effect_get_param_by_name (capture->yuv_effect, "color_range_min"),
+                     color_range_min, sizeof (color_range_min));
+  gs_effect_set_val (gs_effect_get_param_by_name (capture->yuv_effect, "color_range_max"),
+                     color_range_max, sizeof (color_range_max));
+}
+
+static void
+render_yuv_frame (obs_pw_capture    *capture,
+                  const char        *technique,
+                  const obs_pw_rect *rect)
+{
+  if (!capture->yuv_effect)
+    {
+      char *effect_file;
+      char *error = NULL;
+
+      effect_file = obs_module_file ("effects/yuv.effect");
+      capture->yuv_effect = gs_effect_create_from_file (effect_file, &error);
+      bfree (effect_file);
+
+      if (!capture->yuv_effect)
+        {
+          blog (LOG_ERROR, "[pipewire] Failed to load YUV conversion effect: %s",
+                error ? error : "unknown error");
+          bfree (error);
+          return;
+        }
+    }
+
+  gs_effect_set_texture (gs_effect_get_param_by_name (capture->yuv_effect, "image"),
+                         frame_sink_texture_get_gs_texture (capture->memory_textures[0]));
+  gs_effect_set_texture (gs_effect_get_param_by_name (capture->yuv_effect, "image1"),
+                         frame_sink_texture_get_gs_texture (capture->memory_textures[1]));
+  gs_effect_set_texture (gs_effect_get_param_by_name (capture->yuv_effect, "image2"),
+                         frame_sink_texture_get_gs_texture (capture->memory_textures[2]));
+  gs_effect_set_float (gs_effect_get_param_by_name (capture->yuv_effect, "width"),
+                       (float) capture->upload.width);
+  gs_effect_set_float (gs_effect_get_param_by_name (capture->yuv_effect, "height"),
+                       (float) capture->upload.height);
+  set_yuv_color_params (capture);
+
+  while (gs_effect_loop (capture->yuv_effect, technique))
+    draw_frame (capture, rect);
+}
+
+/*
+ * Picks up the frame published by the PipeWire thread that fits the current
+ * video tick best, if any, and uploads or imports it. When several sources
+ * show the same capture, the first one to process uploads the frame, and the
+ * others draw the same textures. Called when rendering, whether the sink
+ * draws or not.
+ */
+static void
+process_frame (obs_pipewire_data *xdg)
+{
+  obs_pw_capture *capture;
+  struct pw_buffer *b;
+
+  frame_sink_lock ();
+
+  capture = xdg->capture;
+  if (capture)
+    {
+      g_mutex_lock (&capture->frame_lock);
+      apply_stream_changes (capture);
+      b = select_frame (capture);
+      if (b)
+        process_buffer (capture, b);
+      g_mutex_unlock (&capture->frame_lock);
+
+      if (xdg->stats.frame_serial != capture->frame_serial)
+        g_atomic_int_inc (&xdg->stats.rendered);
+      else
+        g_atomic_int_inc (&xdg->stats.repeated);
+
+      xdg->stats.frame_serial = capture->frame_serial;
+      maybe_log_stats (capture, xdg, os_gettime_ns ());
+
+      /* Sinks that don't draw are done with the frame once it is processed */
+      if (!frame_sink_draws () &&
+          (capture->texture || capture->tiles) &&
+          capture->timing.rendered == 0)
+        capture->timing.rendered = os_gettime_ns ();
+    }
+
+  frame_sink_unlock ();
 }
 
 void
 obs_pipewire_video_render (obs_pipewire_data *xdg,
                            gs_effect_t       *effect)
 {
+  obs_pw_capture *capture = xdg->capture;
+  uint32_t output_width, output_height;
+  obs_pw_rect view, rect;
+  const char *yuv_technique;
   gs_eparam_t *image;
 
-  if (!xdg->texture)
+  if (!capture)
+    return;
+
+  process_frame (xdg);
+
+  /* Sinks that don't draw only run the pipeline up to here */
+  if (!frame_sink_draws ())
+    return;
+
+  if (!capture->texture && !capture->tiles)
     return;
 
+  if (capture->timing.rendered == 0)
+    capture->timing.rendered = os_gettime_ns ();
+
+  /* Sources are drawn with OBS_SOURCE_CUSTOM_DRAW, so no effect is passed */
+  effect = obs_get_base_effect (OBS_EFFECT_DEFAULT);
   image = gs_effect_get_param_by_name (effect, "image");
-  gs_effect_set_texture (image, xdg->texture);
 
-  if (has_effective_crop (xdg))
+  get_view_rect (capture, &view);
+  apply_region (capture, &capture->format, &xdg->region, &view, &rect);
+  get_output_size (xdg, &output_width, &output_height);
+
+  if (rect.width == 0 || rect.height == 0)
+    return;
+
+  gs_matrix_push ();
+
+  if (output_width != rect.width || output_height != rect.height)
+    {
+      gs_matrix_scale3f ((float) output_width / rect.width,
+                         (float) output_height / rect.height,
+                         1.0f);
+    }
+
+  yuv_technique = spa_pixel_format_to_yuv_technique (capture->format.info.raw.format);
+  if (!capture->texture)
     {
-      gs_draw_sprite_subregion (xdg->texture,
-                                0,
-                                xdg->crop.x,
-                                xdg->crop.y,
-                                xdg->crop.x + xdg->crop.width,
-                                xdg->crop.y + xdg->crop.height);
+      while (gs_effect_loop (effect, "Draw"))
+        draw_tiles (capture, image, &rect);
+    }
+  else if (yuv_technique && capture->texture == capture->memory_textures[0])
+    {
+      render_yuv_frame (capture, yuv_technique, &rect);
     }
   else
     {
-      gs_draw_sprite (xdg->texture, 0, 0, 0);
+      gs_effect_set_texture (image, frame_sink_texture_get_gs_texture (capture->texture));
+
+      while (gs_effect_loop (effect, "Draw"))
+        draw_frame (capture, &rect);
     }
 
-  if (xdg->cursor.visible && xdg->cursor.valid && xdg->cursor.texture)
+  if (xdg->cursor_visible && capture->cursor.valid && capture->cursor.texture)
     {
+      gs_texture_t *cursor_texture = frame_sink_texture_get_gs_texture (capture->cursor.texture);
+
+      /* The cursor position is relative to the view, not to the region */
       gs_matrix_push ();
-      gs_matrix_translate3f ((float)xdg->cursor.x, (float)xdg->cursor.y, 0.0f);
+      gs_matrix_translate3f ((float) capture->cursor.x - (float) (rect.x - view.x),
+                             (float) capture->cursor.y - (float) (rect.y - view.y),
+                             0.0f);
 
-      gs_effect_set_texture (image, xdg->cursor.texture);
-      gs_draw_sprite (xdg->texture, 0, xdg->cursor.width, xdg->cursor.height);
+      gs_effect_set_texture (image, cursor_texture);
+      while (gs_effect_loop (effect, "Draw"))
+        gs_draw_sprite (cursor_texture, 0, capture->cursor.width, capture->cursor.height);
 
       gs_matrix_pop ();
     }
 
-  /* Now that the buffer is consumed, queue it again */
-  maybe_queue_buffer (xdg);
+  gs_matrix_pop ();
 }
 
 void
 obs_pipewire_load (void)
 {
+  const char *trace_path = g_getenv ("OBS_PIPEWIRE_TRACE");
+  const char *sink_name = g_getenv ("OBS_PIPEWIRE_FRAME_SINK");
+
   pw_init (NULL, NULL);
+
+  /* The null sink profiles the pipeline without drawing anything */
+  if (g_strcmp0 (sink_name, obs_pw_null_frame_sink.name) == 0)
+    {
+      blog (LOG_WARNING, "[pipewire] Using the %s frame sink, sources won't show anything",
+            obs_pw_null_frame_sink.name);
+      frame_sink_set (&obs_pw_null_frame_sink);
+    }
+
+  /* The JSON array format allows leaving the array open */
+  if (trace_path && *trace_path)
+    {
+      trace_file = fopen (trace_path, "w");
+      if (trace_file)
+        fputs ("[\n", trace_file);
+      else
+        blog (LOG_WARNING, "[pipewire] Failed to open trace file %s", trace_path);
+    }
 }
@@ -29,6 +29,12 @@ window_capture_get_name (void *type_data)
   return obs_module_text ("WindowCapture");
 }
 
+static const char *
+window_capture_async_get_name (void *type_data)
+{
+  return obs_module_text ("WindowCaptureAsync");
+}
+
 static void *
 window_capture_create (obs_data_t   *settings,
                        obs_source_t *source)
@@ -98,7 +104,7 @@ window_capture_register_source (void)
   struct obs_source_info info = {
     .id = "obs-xdg-window-capture",
     .type = OBS_SOURCE_TYPE_INPUT,
-    .output_flags = OBS_SOURCE_VIDEO,
+    .output_flags = OBS_SOURCE_VIDEO | OBS_SOURCE_CUSTOM_DRAW,
     .get_name = window_capture_get_name,
     .create = window_capture_create,
     .destroy = window_capture_destroy,
@@ -114,4 +120,21 @@ window_capture_register_source (void)
   };
 
   obs_register_source (&info);
+
+  struct obs_source_info async_info = {
+    .id = "obs-xdg-window-capture-async",
+    .type = OBS_SOURCE_TYPE_INPUT,
+    .output_flags = OBS_SOURCE_ASYNC_VIDEO,
+    .get_name = window_capture_async_get_name,
+    .create = window_capture_create,
+    .destroy = window_capture_destroy,
+    .get_defaults = window_capture_get_defaults,
+    .get_properties = window_capture_get_properties,
+    .update = window_capture_update,
+    .show = window_capture_show,
+    .hide = window_capture_hide,
+    .icon_type = OBS_ICON_TYPE_WINDOW_CAPTURE,
+  };
+
+  obs_register_source (&async_info);
 }